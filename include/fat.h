@@ -46,6 +46,7 @@ extern "C" {
 #endif
 
 #include <stdint.h>
+#include <sys/types.h>
 
 #if defined(__gamecube__) || defined (__wii__)
 #  include <ogc/disc_io.h>
@@ -57,6 +58,56 @@ extern "C" {
 #  endif
 #endif
 
+/*
+A disc interface with extra abilities, given by flags in interface.features.
+Pass &interface to fatMount to use them. A function may be NULL if its flag isn't set.
+FEATURE_MEDIUM_CANDISCARD: discardSectors tells the medium that the contents of
+sectors are no longer needed, so that it can erase them ahead of time. The
+sectors of freed clusters are discarded.
+FEATURE_MEDIUM_CANZERO: zeroSectors fills sectors with zeros without the data
+having to be sent, and is used to clear new directory clusters and the space
+added to the end of a file.
+FEATURE_MEDIUM_REENTRANT: readSectors and writeSectors may be called by more
+than one thread at once. Without it, a partition only uses the disc from one
+thread at a time.
+*/
+#ifndef FEATURE_MEDIUM_CANDISCARD
+#define FEATURE_MEDIUM_CANDISCARD	0x00010000
+#endif
+#ifndef FEATURE_MEDIUM_CANZERO
+#define FEATURE_MEDIUM_CANZERO		0x00020000
+#endif
+#ifndef FEATURE_MEDIUM_REENTRANT
+#define FEATURE_MEDIUM_REENTRANT	0x00040000
+#endif
+
+typedef bool (* FN_MEDIUM_DISCARDSECTORS)(sec_t sector, sec_t numSectors);
+typedef bool (* FN_MEDIUM_ZEROSECTORS)(sec_t sector, sec_t numSectors);
+
+typedef struct {
+	DISC_INTERFACE interface;
+	FN_MEDIUM_DISCARDSECTORS discardSectors;
+	FN_MEDIUM_ZEROSECTORS zeroSectors;
+} DISC_INTERFACE_EX;
+
+#ifdef LIBFAT_DISC_IMAGE
+/*
+Only when libfat is built with LIBFAT_DISC_IMAGE defined, on a Linux host.
+Get a disc interface for the disc image file at path, which has 512 byte
+sectors. Discarded sectors are punched out of the file with fallocate, which
+is also used to zero sectors.
+Only one image can be in use at a time. Returns NULL if it can't be opened.
+*/
+extern const DISC_INTERFACE* fatImageInterface (const char* path, bool writable);
+
+/*
+Only when libfat is built with LIBFAT_DISC_IMAGE defined.
+Make every read and write of the disc image take requestUs microseconds, plus
+sectorUs for each sector, to stand in for a slow disc. Both are 0 to start with.
+*/
+extern void fatImageSetLatency (uint32_t requestUs, uint32_t sectorUs);
+#endif
+
 /*
 Initialise any inserted block-devices.
 Add the fat device driver to the devoptab, making it available for standard file functions.
@@ -88,6 +139,57 @@ This will not startup the disc, so you need to call interface->startup(); first.
 */
 extern bool fatMount (const char* name, const DISC_INTERFACE* interface, sec_t startSector, uint32_t cacheSize, uint32_t SectorsPerPage);
 
+/*
+Options for fatMountEx
+FAT_MOUNT_MIRROR_* select when the backup copies of the FAT are brought up to date
+with the active FAT. Only one of these may be given.
+*/
+#define FAT_MOUNT_MIRROR_FLUSH		0x00000000	// Update the backup FATs whenever the cache is flushed (default)
+#define FAT_MOUNT_MIRROR_UNMOUNT	0x00000001	// Only update the backup FATs when unmounting
+#define FAT_MOUNT_MIRROR_NONE		0x00000002	// Never update the backup FATs
+#define FAT_MOUNT_MIRROR_MASK		0x00000003
+
+/*
+FAT_MOUNT_ALLOC_* select how free clusters are chosen. Only one of these may be given.
+*/
+#define FAT_MOUNT_ALLOC_FIRSTFIT	0x00000000	// Always use the lowest free cluster (default)
+#define FAT_MOUNT_ALLOC_NEXTFIT		0x00000004	// Keep files together, continuing on from the last allocation
+#define FAT_MOUNT_ALLOC_MASK		0x0000000C
+
+/*
+FAT_MOUNT_DELAYED_ALLOC holds data written to the end of a file in memory, without
+giving it any clusters, until the file is synchronised or closed or the buffer fills.
+The clusters are then allocated together, so that files written at the same time
+don't have their clusters mixed up with each other.
+*/
+#define FAT_MOUNT_DELAYED_ALLOC		0x00000010
+
+/*
+FAT_MOUNT_FAT_IN_RAM reads the whole FAT into memory when mounting, decoded into
+one 32 bit entry per cluster, so that following cluster chains and finding free
+clusters don't go through the cache. Changed entries are written back to the disc
+whenever the cache is flushed. Use fatGetFatTableSize to find out how much memory
+this takes. If there isn't enough memory, the FAT is used through the cache as usual.
+*/
+#define FAT_MOUNT_FAT_IN_RAM		0x00000020
+
+#define FAT_MOUNT_DEFAULT			0x00000000
+
+/*
+Same as fatMount, with additional mount options.
+options is a combination of the FAT_MOUNT_* flags above.
+*/
+extern bool fatMountEx (const char* name, const DISC_INTERFACE* interface, sec_t startSector, uint32_t cacheSize, uint32_t SectorsPerPage, uint32_t options);
+
+/*
+Get the number of bytes of memory that mounting the partition at startSector with
+FAT_MOUNT_FAT_IN_RAM would use to hold its FAT. As with fatMount, a startSector of 0
+means the active partition or the first valid partition on the disc.
+This will not startup the disc, so you need to call interface->startup(); first.
+Returns 0 if there is no FAT partition there.
+*/
+extern uint32_t fatGetFatTableSize (const DISC_INTERFACE* interface, sec_t startSector);
+
 /*
 Unmount the partition specified by name.
 If there are open files, it will attempt to synchronise them to disc.
@@ -113,6 +215,234 @@ Methods to modify DOS File Attributes
 int	FAT_getAttr(const char *file);
 int	FAT_setAttr(const char *file, uint8_t attr );
 
+/*
+Move the clusters of a file so that it is stored contiguously on the disc.
+The file may be open while this is done.
+Returns 0 on success, or -1 with errno set on failure. errno is ENOSPC
+if there is no free space large enough to hold the file in one piece.
+*/
+extern int fatDefragFile (const char* path);
+
+/*
+Defragment every file on the partition specified by name, a little at a time.
+At most budget clusters are moved by each call, with 0 meaning no limit.
+Each call carries on from where the last one stopped.
+Returns 1 once every file has been done, 0 if there is more to do, or
+-1 with errno set on failure.
+*/
+extern int fatDefragVolume (const char* name, uint32_t budget);
+
+/*
+Give the file open as fd enough clusters to hold size bytes, without changing its size.
+Clusters are taken from the smallest run of free clusters that the file fits in,
+so that the largest free runs are kept whole for other files. Any clusters not
+used by the time the file is closed are given back.
+Returns 0 on success, or -1 with errno set on failure. errno is ENOSPC if there
+are not enough free clusters, in which case none are allocated.
+*/
+extern int fatPreallocate (int fd, uint32_t size);
+
+/*
+One segment of a vectored read or write, laid out the same as POSIX struct iovec
+*/
+typedef struct {
+	void*  iov_base;
+	size_t iov_len;
+} FAT_IOVEC;
+
+#define FAT_IOV_MAX 1024
+
+/*
+Read into or write from iovcnt segments at the current position of the file open
+as fd, as readv and writev do. The partition is locked once for all of them, and
+the file position is moved on once by the total length. Small segments written
+together are gathered into one buffer, so that they go to the disc in one write.
+Returns the number of bytes read or written, which is less than the total length
+at the end of the file or on an error after some data was transferred, or -1 with
+errno set if nothing could be.
+*/
+extern ssize_t fatReadv (int fd, const FAT_IOVEC* iov, int iovcnt);
+extern ssize_t fatWritev (int fd, const FAT_IOVEC* iov, int iovcnt);
+
+/*
+Read or write len bytes at offset in the file opened as fd, the same as POSIX
+pread and pwrite. The file position is left where it was, and fatPwrite writes
+at offset even if the file was opened for appending. Writing past the end of the
+file fills the gap with zeros. The place in the cluster chain that each call
+finishes at is remembered, so that a run of calls working along the file doesn't
+follow the chain from the start every time.
+Returns the number of bytes read or written, which fatPread makes less than len at
+the end of the file, or -1 with errno set.
+*/
+extern ssize_t fatPread (int fd, void* buf, size_t len, off_t offset);
+extern ssize_t fatPwrite (int fd, const void* buf, size_t len, off_t offset);
+
+/*
+A run of consecutive sectors on the disc, counted from the start of the disc
+*/
+typedef struct {
+	sec_t sector;
+	sec_t count;
+} FAT_EXTENT;
+
+/*
+Find where the bytes from offset to offset + length - 1 of the file opened as fd
+are stored on the disc, so that they can be read straight from the device.
+Up to maxExtents runs of sectors are stored in extents, in file order. The first
+and last sectors may also hold bytes outside of the range, and the part of the
+range past the end of the file has no sectors. Everything the file has written
+to those sectors is on the disc before this returns, rather than in the cache.
+The sectors are only valid until the file is next written to, truncated or
+defragmented.
+Returns the number of runs stored, which is maxExtents if there may be more, or
+-1 with errno set on failure.
+*/
+extern int fatGetFileExtents (int fd, off_t offset, size_t length, FAT_EXTENT* extents, int maxExtents);
+
+/*
+Set how much data written to the end of the file opened as fd may be held in
+memory, without going through the cache or being given clusters, before it is
+written out. This starts off as set by FAT_MOUNT_DELAYED_ALLOC, and a size of 0
+writes straight through. Data is also written out when the file is synchronised
+or closed, and once it has been held back for maxAge seconds, if maxAge isn't 0.
+That is checked when the file is written to and by fatFlushAgedWrites.
+Returns 0 on success, or -1 with errno set on failure.
+*/
+extern int fatSetWriteBehind (int fd, uint32_t size, uint32_t maxAge);
+
+/*
+Synchronise every open file on the partition specified by name that has held
+back data for longer than the maxAge given to fatSetWriteBehind. Call this
+now and then so that data isn't held back for long after the last write.
+Returns 0 on success, or -1 with errno set if a file couldn't be synchronised.
+*/
+extern int fatFlushAgedWrites (const char* name);
+
+#define FAT_AIO_READ  0
+#define FAT_AIO_WRITE 1
+
+typedef struct _FAT_AIOCB FAT_AIOCB;
+
+typedef void (*FAT_AIO_CALLBACK) (FAT_AIOCB* aiocb);
+
+/*
+An asynchronous read or write of len bytes at offset in the file opened as fd.
+The caller fills in the first part and must keep the structure and the buffer
+until the request has finished. The rest is filled in by libfat.
+Once fatAioError no longer gives EINPROGRESS, libfat is done with the structure
+and the caller may free or reuse it, even while the callback is still running.
+The callback may free it too, but not use it after that.
+*/
+struct _FAT_AIOCB {
+	int              fd;
+	off_t            offset;
+	void*            buf;
+	size_t           len;
+	FAT_AIO_CALLBACK callback;		// Called by the thread that carried out the request once it has finished, or NULL
+	void*            userData;		// Not used by libfat
+	int              opcode;		// FAT_AIO_READ or FAT_AIO_WRITE
+	int              error;
+	ssize_t          result;
+	void*            file;
+	void*            queue;
+	FAT_AIOCB*       next;
+};
+
+/*
+Start reading or writing, the same as fatPread or fatPwrite, then return
+without waiting for it to finish. Requests are carried out in the order they
+were made by a few worker threads for each partition, so requests on different
+partitions overlap. If threads can't be started, the request is carried out
+before returning, and the callback is called before returning too.
+The file must not be closed and the partition not unmounted until every request
+on them has finished.
+Returns 0 if the request was made, or -1 with errno set if it couldn't be, in
+which case fatAioError gives the same error and fatAioReturn gives -1.
+*/
+extern int fatAioRead (FAT_AIOCB* aiocb);
+extern int fatAioWrite (FAT_AIOCB* aiocb);
+
+/*
+Returns EINPROGRESS while the request is being carried out, 0 once it has
+finished, or the errno it failed with
+*/
+extern int fatAioError (const FAT_AIOCB* aiocb);
+
+/*
+Returns what fatPread or fatPwrite would have for a finished request,
+or -1 while it is still being carried out
+*/
+extern ssize_t fatAioReturn (const FAT_AIOCB* aiocb);
+
+#define FAT_COPY_OVERWRITE	0x00000001	// Replace the destination if it already exists
+
+/*
+Called as fatCopyFileEx goes along with the number of bytes copied so far and
+the size of the file. The partition isn't locked while it runs.
+Return false to stop the copy.
+*/
+typedef bool (*FAT_COPY_CALLBACK) (uint32_t copied, uint32_t total, void* userData);
+
+/*
+Copy the file at src to a new file at dst on the same partition. The new file is
+given all of its clusters at once, in as few runs as there is room for, and the
+data goes between the disc and a buffer many sectors at a time rather than
+through the cache. Unless flags includes FAT_COPY_OVERWRITE, dst mustn't exist.
+If the copy fails or is stopped, dst is removed.
+Returns 0 on success, or -1 with errno set on failure -- EXDEV if the files are
+on different partitions, ECANCELED if progress stopped the copy.
+*/
+extern int fatCopyFile (const char* src, const char* dst, uint32_t flags);
+extern int fatCopyFileEx (const char* src, const char* dst, uint32_t flags, FAT_COPY_CALLBACK progress, void* userData);
+
+/*
+How a file is laid out on the disc. The average extent length is
+clusters / extents.
+*/
+typedef struct {
+	uint32_t clusters;				// Clusters used by the file
+	uint32_t extents;				// Runs of consecutive clusters
+	uint32_t largestExtent;			// Clusters in the longest run
+} FAT_FILE_LAYOUT;
+
+#define FAT_LAYOUT_BUCKETS 16
+
+/*
+How a whole partition is laid out. Sizes are in clusters.
+*/
+typedef struct {
+	uint32_t bytesPerCluster;
+	uint32_t totalClusters;
+	uint32_t freeClusters;
+	uint32_t freeExtents;			// Runs of consecutive free clusters
+	uint32_t largestFreeExtent;
+	uint32_t freeExtentHistogram[FAT_LAYOUT_BUCKETS];	// Entry i counts free runs of 2^i to 2^(i+1)-1 clusters, the last also counts longer runs
+	uint32_t files;
+	uint32_t fragmentedFiles;		// Files in more than one extent
+	uint32_t fileClusters;
+	uint32_t fileExtents;
+	uint32_t directories;			// Not counting a FAT12/16 root directory, which has no clusters
+	uint32_t directoryClusters;
+	uint32_t directoryExtents;		// More extents than directories means directories are scattered
+} FAT_VOLUME_LAYOUT;
+
+typedef void (*FAT_LAYOUT_CALLBACK) (const char* path, const FAT_FILE_LAYOUT* layout, void* userData);
+
+/*
+Get the layout of a single file.
+Returns 0 on success, or -1 with errno set on failure.
+*/
+extern int fatGetFileLayout (const char* path, FAT_FILE_LAYOUT* layout);
+
+/*
+Get the layout of the partition specified by name.
+If fileCallback isn't NULL, it is called with the path and layout of every file.
+The partition is locked while the callback runs, so it must not use the partition.
+Returns 0 on success, or -1 with errno set on failure. If the whole tree couldn't
+be walked, layout only covers the part that was.
+*/
+extern int fatGetVolumeLayout (const char* name, FAT_VOLUME_LAYOUT* layout, FAT_LAYOUT_CALLBACK fileCallback, void* userData);
+
 #define LIBFAT_FEOS_MULTICWD
 
 #ifdef __cplusplus
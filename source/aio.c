@@ -0,0 +1,289 @@
+/*
+ aio.c
+ Reads and writes that are carried out by worker threads while the
+ caller gets on with something else
+
+ Copyright (c) 2006 Michael "Chishm" Chisholm
+
+ Redistribution and use in source and binary forms, with or without modification,
+ are permitted provided that the following conditions are met:
+
+  1. Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+  2. Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation and/or
+     other materials provided with the distribution.
+  3. The name of the author may not be used to endorse or promote products derived
+     from this software without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY
+ AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE
+ LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+#include "aio.h"
+
+#include <errno.h>
+
+#include "fatfile.h"
+#include "mem_allocate.h"
+
+static AIO_QUEUE* _FAT_aio_create (void) {
+	AIO_QUEUE* queue;
+	unsigned int i;
+
+	queue = (AIO_QUEUE*) _FAT_mem_allocate (sizeof(AIO_QUEUE));
+	if (queue == NULL) {
+		return NULL;
+	}
+
+	_FAT_lock_init (&queue->lock);
+	queue->first = NULL;
+	queue->last = NULL;
+	for (i = 0; i < AIO_WORKERS; i++) {
+		queue->workers[i].queue = queue;
+		queue->workers[i].started = false;
+		queue->workers[i].running = false;
+	}
+
+	return queue;
+}
+
+/*
+Take the oldest request off the queue, or return NULL if there isn't one.
+The queue must be locked.
+*/
+static FAT_AIOCB* _FAT_aio_take (AIO_QUEUE* queue) {
+	FAT_AIOCB* aiocb = queue->first;
+
+	if (aiocb != NULL) {
+		queue->first = aiocb->next;
+		if (queue->first == NULL) {
+			queue->last = NULL;
+		}
+	}
+
+	return aiocb;
+}
+
+/*
+Carry out a request, then hand back its result and tell the caller
+*/
+static void _FAT_aio_run (AIO_QUEUE* queue, FAT_AIOCB* aiocb) {
+	FILE_STRUCT* file = (FILE_STRUCT*) aiocb->file;
+	FAT_AIO_CALLBACK callback = aiocb->callback;
+	ssize_t result;
+	int error = 0;
+
+	if (aiocb->opcode == FAT_AIO_WRITE) {
+		result = _FAT_file_pwrite (file, aiocb->buf, aiocb->len, aiocb->offset);
+	} else {
+		result = _FAT_file_pread (file, aiocb->buf, aiocb->len, aiocb->offset);
+	}
+	if (result < 0) {
+		error = errno;
+	}
+
+	// Once the result is in, the caller may free or reuse the aiocb, so it isn't
+	// touched again other than to pass it to the callback
+	_FAT_lock (&queue->lock);
+	aiocb->result = result;
+	aiocb->error = error;
+	_FAT_unlock (&queue->lock);
+
+	if (callback) {
+		callback (aiocb);
+	}
+}
+
+static void* _FAT_aio_worker (void* arg) {
+	AIO_WORKER* worker = (AIO_WORKER*) arg;
+	AIO_QUEUE* queue = worker->queue;
+	FAT_AIOCB* aiocb;
+
+	for (;;) {
+		_FAT_lock (&queue->lock);
+		aiocb = _FAT_aio_take (queue);
+		if (aiocb == NULL) {
+			// Anything added from now on starts a new worker
+			worker->running = false;
+			_FAT_unlock (&queue->lock);
+			return NULL;
+		}
+		_FAT_unlock (&queue->lock);
+
+		_FAT_aio_run (queue, aiocb);
+	}
+}
+
+/*
+Queue a request on the partition the file is on and make sure a worker will
+pick it up. Without threads, the request is carried out before returning.
+*/
+static int _FAT_aio_submit (FAT_AIOCB* aiocb, int opcode) {
+	FILE_STRUCT* file;
+	PARTITION* partition;
+	AIO_QUEUE* queue;
+	AIO_WORKER* worker;
+	bool haveWorker = false;
+	bool triedStart = false;
+	unsigned int i;
+
+	if (aiocb == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	// A request that can't be queued stays finished, failed with the same error
+	aiocb->queue = NULL;
+	aiocb->result = -1;
+
+	file = _FAT_file_fromFd (aiocb->fd);
+	if ((file == NULL) || !file->inUse || ((opcode == FAT_AIO_WRITE) ? !file->write : !file->read)) {
+		errno = aiocb->error = EBADF;
+		return -1;
+	}
+	if (aiocb->offset < 0) {
+		errno = aiocb->error = EINVAL;
+		return -1;
+	}
+
+	partition = file->partition;
+	_FAT_lock (&partition->lock);
+	if (partition->aio == NULL) {
+		partition->aio = _FAT_aio_create ();
+	}
+	queue = partition->aio;
+	_FAT_unlock (&partition->lock);
+
+	if (queue == NULL) {
+		errno = aiocb->error = ENOMEM;
+		return -1;
+	}
+
+	aiocb->opcode = opcode;
+	aiocb->file = file;
+	aiocb->queue = queue;
+	aiocb->result = 0;
+	aiocb->error = EINPROGRESS;
+	aiocb->next = NULL;
+
+	_FAT_lock (&queue->lock);
+
+	if (queue->last) {
+		queue->last->next = aiocb;
+	} else {
+		queue->first = aiocb;
+	}
+	queue->last = aiocb;
+
+	// Start another worker if there is room for one, reusing the slot of one that has finished
+	for (i = 0; i < AIO_WORKERS; i++) {
+		worker = &queue->workers[i];
+		if (!worker->running && !triedStart) {
+			triedStart = true;
+			if (worker->started) {
+				_FAT_thread_join (&worker->thread);
+			}
+			worker->started = _FAT_thread_start (&worker->thread, _FAT_aio_worker, worker);
+			worker->running = worker->started;
+		}
+		if (worker->running) {
+			haveWorker = true;
+		}
+	}
+
+	_FAT_unlock (&queue->lock);
+
+	if (!haveWorker) {
+		// No threads to be had, so the caller does the work
+		for (;;) {
+			_FAT_lock (&queue->lock);
+			aiocb = _FAT_aio_take (queue);
+			_FAT_unlock (&queue->lock);
+			if (aiocb == NULL) {
+				break;
+			}
+			_FAT_aio_run (queue, aiocb);
+		}
+	}
+
+	return 0;
+}
+
+void _FAT_aio_deinit (PARTITION* partition) {
+	AIO_QUEUE* queue = partition->aio;
+	unsigned int i;
+
+	if (queue == NULL) {
+		return;
+	}
+
+	// Workers only finish once the queue is empty
+	for (i = 0; i < AIO_WORKERS; i++) {
+		if (queue->workers[i].started) {
+			_FAT_thread_join (&queue->workers[i].thread);
+		}
+	}
+
+	_FAT_lock_deinit (&queue->lock);
+	_FAT_mem_free (queue);
+	partition->aio = NULL;
+}
+
+int fatAioRead (FAT_AIOCB* aiocb) {
+	return _FAT_aio_submit (aiocb, FAT_AIO_READ);
+}
+
+int fatAioWrite (FAT_AIOCB* aiocb) {
+	return _FAT_aio_submit (aiocb, FAT_AIO_WRITE);
+}
+
+int fatAioError (const FAT_AIOCB* aiocb) {
+	AIO_QUEUE* queue;
+	int error;
+
+	if (aiocb == NULL) {
+		return EINVAL;
+	}
+
+	// Never queued, so there's nothing to wait for
+	queue = (AIO_QUEUE*) aiocb->queue;
+	if (queue == NULL) {
+		return aiocb->error;
+	}
+
+	_FAT_lock (&queue->lock);
+	error = aiocb->error;
+	_FAT_unlock (&queue->lock);
+
+	return error;
+}
+
+ssize_t fatAioReturn (const FAT_AIOCB* aiocb) {
+	AIO_QUEUE* queue;
+	ssize_t result;
+
+	if (aiocb == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	queue = (AIO_QUEUE*) aiocb->queue;
+	if (queue == NULL) {
+		return aiocb->result;
+	}
+
+	_FAT_lock (&queue->lock);
+	result = (aiocb->error == EINPROGRESS) ? -1 : aiocb->result;
+	_FAT_unlock (&queue->lock);
+
+	return result;
+}
@@ -0,0 +1,70 @@
+/*
+ aio.h
+ Reads and writes that are carried out by worker threads while the
+ caller gets on with something else
+
+ Copyright (c) 2006 Michael "Chishm" Chisholm
+
+ Redistribution and use in source and binary forms, with or without modification,
+ are permitted provided that the following conditions are met:
+
+  1. Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+  2. Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation and/or
+     other materials provided with the distribution.
+  3. The name of the author may not be used to endorse or promote products derived
+     from this software without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY
+ AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE
+ LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+#ifndef _AIO_H
+#define _AIO_H
+
+#include "common.h"
+#include "partition.h"
+#include "lock.h"
+
+// Most worker threads carrying out requests for one partition at a time
+#define AIO_WORKERS 2
+
+struct _AIO_QUEUE;
+
+typedef struct {
+	struct _AIO_QUEUE* queue;
+	thread_t           thread;
+	bool               started;		// A thread was started for this worker and hasn't been joined yet
+	bool               running;		// The thread is still taking requests from the queue
+} AIO_WORKER;
+
+/*
+Requests waiting for a worker on one partition. A worker takes requests until
+the queue is empty, then finishes. Another is started when a request is added
+and fewer than AIO_WORKERS are running.
+*/
+struct _AIO_QUEUE {
+	mutex_t    lock;			// Only guards the queue, the partition has its own lock
+	FAT_AIOCB* first;			// Oldest request waiting
+	FAT_AIOCB* last;
+	AIO_WORKER workers[AIO_WORKERS];
+};
+
+typedef struct _AIO_QUEUE AIO_QUEUE;
+
+/*
+Wait for every request on the partition to finish and stop its workers.
+Must be called without the partition locked, since the workers need to lock it.
+*/
+void _FAT_aio_deinit (PARTITION* partition);
+
+#endif // _AIO_H
@@ -50,6 +50,7 @@ CACHE* _FAT_cache_constructor (unsigned int numberOfPages, unsigned int sectorsP
 	CACHE* cache;
 	unsigned int i;
 	CACHE_ENTRY* cacheEntries;
+	uint8_t* zeroBuffer;
 
 	if (numberOfPages < 2) {
 		numberOfPages = 2;
@@ -69,10 +70,22 @@ CACHE* _FAT_cache_constructor (unsigned int numberOfPages, unsigned int sectorsP
 	cache->numberOfPages = numberOfPages;
 	cache->sectorsPerPage = sectorsPerPage;
 	cache->bytesPerSector = bytesPerSector;
+	cache->owner = NULL;
+	cache->prefetchBuffer = NULL;
+	cache->prefetchSectors = 0;
+	cache->accessCounter = 0;
 
+	zeroBuffer = (uint8_t*) _FAT_mem_align (sectorsPerPage * bytesPerSector);
+	if (zeroBuffer == NULL) {
+		_FAT_mem_free (cache);
+		return NULL;
+	}
+	memset (zeroBuffer, 0, sectorsPerPage * bytesPerSector);
+	cache->zeroBuffer = zeroBuffer;
 
 	cacheEntries = (CACHE_ENTRY*) _FAT_mem_allocate ( sizeof(CACHE_ENTRY) * numberOfPages);
 	if (cacheEntries == NULL) {
+		_FAT_mem_free (zeroBuffer);
 		_FAT_mem_free (cache);
 		return NULL;
 	}
@@ -82,6 +95,7 @@ CACHE* _FAT_cache_constructor (unsigned int numberOfPages, unsigned int sectorsP
 		cacheEntries[i].count = 0;
 		cacheEntries[i].last_access = 0;
 		cacheEntries[i].dirty = false;
+		cacheEntries[i].owner = NULL;
 		cacheEntries[i].cache = (uint8_t*) _FAT_mem_align ( sectorsPerPage * bytesPerSector );
 	}
 
@@ -100,36 +114,59 @@ void _FAT_cache_destructor (CACHE* cache) {
 		_FAT_mem_free (cache->cacheEntries[i].cache);
 	}
 	_FAT_mem_free (cache->cacheEntries);
+	_FAT_mem_free ((uint8_t*)cache->zeroBuffer);
+	if (cache->prefetchBuffer) {
+		_FAT_mem_free (cache->prefetchBuffer);
+	}
 	_FAT_mem_free (cache);
 }
 
 
-static u32 accessCounter = 0;
-
-static u32 accessTime(){
-	accessCounter++;
-	return accessCounter;
+/*
+Each cache counts its own accesses, so that caches locked by different
+partitions never share the counter
+*/
+static u32 accessTime(CACHE* cache){
+	cache->accessCounter++;
+	return cache->accessCounter;
 }
 
 
-static CACHE_ENTRY* _FAT_cache_getPage(CACHE *cache,sec_t sector)
+/*
+Find the cached page that holds sector, or return NULL if it isn't cached
+*/
+static CACHE_ENTRY* _FAT_cache_findPage(CACHE *cache,sec_t sector)
 {
 	unsigned int i;
 	CACHE_ENTRY* cacheEntries = cache->cacheEntries;
 	unsigned int numberOfPages = cache->numberOfPages;
-	unsigned int sectorsPerPage = cache->sectorsPerPage;
-
-	bool foundFree = false;
-	unsigned int oldUsed = 0;
-	unsigned int oldAccess = UINT_MAX;
 
 	for(i=0;i<numberOfPages;i++) {
 		if(sector>=cacheEntries[i].sector && sector<(cacheEntries[i].sector + cacheEntries[i].count)) {
-			cacheEntries[i].last_access = accessTime();
+			cacheEntries[i].last_access = accessTime(cache);
 			return &(cacheEntries[i]);
 		}
+	}
 
-		if(foundFree==false && (cacheEntries[i].sector==CACHE_FREE || cacheEntries[i].last_access<oldAccess)) {
+	return NULL;
+}
+
+/*
+Free up a page to load new sectors into, taking an unused one if there is one,
+otherwise the least recently used one, written back first if it is dirty
+*/
+static CACHE_ENTRY* _FAT_cache_claimPage(CACHE *cache)
+{
+	unsigned int i;
+	CACHE_ENTRY* cacheEntries = cache->cacheEntries;
+	unsigned int numberOfPages = cache->numberOfPages;
+
+	bool foundFree = false;
+	unsigned int oldUsed = 0;
+	unsigned int oldAccess = UINT_MAX;
+
+	for(i=0;i<numberOfPages && !foundFree;i++) {
+		if(cacheEntries[i].sector==CACHE_FREE || cacheEntries[i].last_access<oldAccess) {
 			if(cacheEntries[i].sector==CACHE_FREE) foundFree = true;
 			oldUsed = i;
 			oldAccess = cacheEntries[i].last_access;
@@ -141,17 +178,49 @@ static CACHE_ENTRY* _FAT_cache_getPage(CACHE *cache,sec_t sector)
 		cacheEntries[oldUsed].dirty = false;
 	}
 
+	return &(cacheEntries[oldUsed]);
+}
+
+static CACHE_ENTRY* _FAT_cache_getPage(CACHE *cache,sec_t sector)
+{
+	CACHE_ENTRY* entry;
+	unsigned int sectorsPerPage = cache->sectorsPerPage;
+
+	entry = _FAT_cache_findPage(cache,sector);
+	if(entry!=NULL) return entry;
+
+	entry = _FAT_cache_claimPage(cache);
+	if(entry==NULL) return NULL;
+
 	sector = (sector/sectorsPerPage)*sectorsPerPage; // align base sector to page size
 	sec_t next_page = sector + sectorsPerPage;
 	if(next_page > cache->endOfPartition)	next_page = cache->endOfPartition;
 
-	if(!_FAT_disc_readSectors(cache->disc,sector,next_page-sector,cacheEntries[oldUsed].cache)) return NULL;
+	if(!_FAT_disc_readSectors(cache->disc,sector,next_page-sector,entry->cache)) {
+		entry->sector = CACHE_FREE;
+		entry->count = 0;
+		return NULL;
+	}
+
+	entry->sector = sector;
+	entry->count = next_page-sector;
+	entry->last_access = accessTime(cache);
 
-	cacheEntries[oldUsed].sector = sector;
-	cacheEntries[oldUsed].count = next_page-sector;
-	cacheEntries[oldUsed].last_access = accessTime();
+	return entry;
+}
 
-	return &(cacheEntries[oldUsed]);
+/*
+Mark a page dirty on behalf of the cache's current owner. A page dirtied by
+more than one owner belongs to all of them.
+*/
+static void _FAT_cache_markDirty (CACHE* cache, CACHE_ENTRY* entry)
+{
+	if (!entry->dirty) {
+		entry->owner = cache->owner;
+	} else if (entry->owner != cache->owner) {
+		entry->owner = CACHE_OWNER_SHARED;
+	}
+	entry->dirty = true;
 }
 
 bool _FAT_cache_readSectors(CACHE *cache,sec_t sector,sec_t numSectors,void *buffer)
@@ -211,6 +280,19 @@ bool _FAT_cache_readLittleEndianValue (CACHE* cache, uint32_t *value, sec_t sect
   return true;
 }
 
+/*
+Returns a pointer to a sector within a cache page, without copying it
+*/
+const uint8_t* _FAT_cache_peekSector (CACHE* cache, sec_t sector)
+{
+	CACHE_ENTRY *entry;
+
+	entry = _FAT_cache_getPage(cache,sector);
+	if(entry==NULL) return NULL;
+
+	return entry->cache + ((sector - entry->sector) * cache->bytesPerSector);
+}
+
 /*
 Writes some data to a cache page, making sure it is loaded into memory first.
 */
@@ -227,7 +309,7 @@ bool _FAT_cache_writePartialSector (CACHE* cache, const void* buffer, sec_t sect
 	sec = sector - entry->sector;
 	memcpy(entry->cache + ((sec*cache->bytesPerSector) + offset),buffer,size);
 
-	entry->dirty = true;
+	_FAT_cache_markDirty (cache, entry);
 	return true;
 }
 
@@ -244,6 +326,20 @@ bool _FAT_cache_writeLittleEndianValue (CACHE* cache, const uint32_t value, sec_
   return _FAT_cache_writePartialSector(cache, buf, sector, offset, size);
 }
 
+/*
+Returns a writable pointer to a sector within a cache page, marking the page dirty
+*/
+uint8_t* _FAT_cache_modifySector (CACHE* cache, sec_t sector)
+{
+	CACHE_ENTRY *entry;
+
+	entry = _FAT_cache_getPage(cache,sector);
+	if(entry==NULL) return NULL;
+
+	_FAT_cache_markDirty (cache, entry);
+	return entry->cache + ((sector - entry->sector) * cache->bytesPerSector);
+}
+
 /*
 Writes some data to a cache page, zeroing out the page first
 */
@@ -261,7 +357,7 @@ bool _FAT_cache_eraseWritePartialSector (CACHE* cache, const void* buffer, sec_t
 	memset(entry->cache + (sec*cache->bytesPerSector),0,cache->bytesPerSector);
 	memcpy(entry->cache + ((sec*cache->bytesPerSector) + offset),buffer,size);
 
-	entry->dirty = true;
+	_FAT_cache_markDirty (cache, entry);
 	return true;
 }
 
@@ -288,8 +384,71 @@ bool _FAT_cache_writeSectors (CACHE* cache, sec_t sector, sec_t numSectors, cons
 		sector += secs_to_write;
 		numSectors -= secs_to_write;
 
-		entry->dirty = true;
+		_FAT_cache_markDirty (cache, entry);
+	}
+	return true;
+}
+
+void _FAT_cache_updateSectors (CACHE* cache, sec_t sector, sec_t numSectors, const void* buffer)
+{
+	unsigned int i;
+	CACHE_ENTRY* entry;
+	sec_t first, last;
+
+	for (i = 0; i < cache->numberOfPages; i++) {
+		entry = &cache->cacheEntries[i];
+		if (entry->sector == CACHE_FREE) {
+			continue;
+		}
+
+		first = (sector > entry->sector) ? sector : entry->sector;
+		last = (sector + numSectors < entry->sector + entry->count) ? sector + numSectors : entry->sector + entry->count;
+		if (first < last) {
+			memcpy (entry->cache + ((first - entry->sector) * cache->bytesPerSector),
+				(const uint8_t*)buffer + ((first - sector) * cache->bytesPerSector),
+				(last - first) * cache->bytesPerSector);
+		}
+	}
+}
+
+bool _FAT_cache_zeroSectors (CACHE* cache, sec_t sector, sec_t numSectors)
+{
+	unsigned int i;
+	CACHE_ENTRY* entry;
+	sec_t first, last;
+	sec_t count;
+
+	if (numSectors < cache->sectorsPerPage) {
+		return _FAT_cache_writeSectors (cache, sector, numSectors, cache->zeroBuffer);
 	}
+
+	for (i = 0; i < cache->numberOfPages; i++) {
+		entry = &cache->cacheEntries[i];
+		if (entry->sector == CACHE_FREE) {
+			continue;
+		}
+
+		first = (sector > entry->sector) ? sector : entry->sector;
+		last = (sector + numSectors < entry->sector + entry->count) ? sector + numSectors : entry->sector + entry->count;
+		if (first < last) {
+			memset (entry->cache + ((first - entry->sector) * cache->bytesPerSector), 0,
+				(last - first) * cache->bytesPerSector);
+		}
+	}
+
+	if (_FAT_disc_canZero (cache->disc)) {
+		return _FAT_disc_zeroSectors (cache->disc, sector, numSectors);
+	}
+
+	while (numSectors > 0) {
+		count = (numSectors < cache->sectorsPerPage) ? numSectors : cache->sectorsPerPage;
+		if (!_FAT_disc_writeSectors (cache->disc, sector, count, cache->zeroBuffer)) {
+			return false;
+		}
+		sector += count;
+		numSectors -= count;
+	}
+
 	return true;
 }
 
@@ -311,6 +470,146 @@ bool _FAT_cache_flush (CACHE* cache) {
 	return true;
 }
 
+/*
+Get the buffer for _FAT_cache_prefetch to read runs of pages into, allocating it
+the first time. If there isn't the memory for maxRun sectors, it makes do with
+fewer, as long as that is more than one page.
+Returns the number of sectors the buffer holds, or 0 if there isn't one.
+*/
+static sec_t _FAT_cache_prefetchBuffer (CACHE* cache, sec_t maxRun) {
+	unsigned int sectorsPerPage = cache->sectorsPerPage;
+
+	while ((cache->prefetchBuffer == NULL) && (maxRun >= 2 * sectorsPerPage)) {
+		cache->prefetchBuffer = (uint8_t*) _FAT_mem_align (maxRun * cache->bytesPerSector);
+		if (cache->prefetchBuffer != NULL) {
+			cache->prefetchSectors = maxRun;
+		} else {
+			maxRun = ((maxRun / 2) / sectorsPerPage) * sectorsPerPage;
+		}
+	}
+
+	return (cache->prefetchBuffer != NULL) ? cache->prefetchSectors : 0;
+}
+
+bool _FAT_cache_prefetch (CACHE* cache, sec_t sector, sec_t numSectors)
+{
+	unsigned int sectorsPerPage = cache->sectorsPerPage;
+	sec_t end = sector + numSectors;
+	sec_t runStart, runEnd, page;
+	sec_t maxRun = (cache->numberOfPages / 2) * sectorsPerPage;
+	uint8_t* buffer;
+	CACHE_ENTRY* entry;
+
+#ifdef LIMIT_SECTORS
+	if (maxRun > LIMIT_SECTORS) {
+		maxRun = (LIMIT_SECTORS / sectorsPerPage) * sectorsPerPage;
+	}
+#endif
+	if (maxRun < 2 * sectorsPerPage) {
+		// Not worth it unless more than one page can be read at a time
+		return true;
+	}
+
+	if (end > cache->endOfPartition) {
+		end = cache->endOfPartition;
+	}
+	runStart = (sector / sectorsPerPage) * sectorsPerPage;
+
+	maxRun = _FAT_cache_prefetchBuffer (cache, maxRun);
+	if (maxRun == 0) {
+		// Without a buffer, each page is read straight into the cache
+		maxRun = sectorsPerPage;
+	}
+	buffer = cache->prefetchBuffer;
+
+	while (runStart < end) {
+		// Skip pages that are already cached
+		if (_FAT_cache_findPage (cache, runStart) != NULL) {
+			runStart += sectorsPerPage;
+			continue;
+		}
+
+		// Gather the run of pages that aren't, up to what the buffer holds
+		runEnd = runStart + sectorsPerPage;
+		while ((runEnd < end) && (runEnd - runStart < maxRun) && (_FAT_cache_findPage (cache, runEnd) == NULL)) {
+			runEnd += sectorsPerPage;
+		}
+		if (runEnd > cache->endOfPartition) {
+			runEnd = cache->endOfPartition;
+		}
+
+		if (runEnd - runStart <= sectorsPerPage) {
+			// A single page needs no gathering
+			if (_FAT_cache_getPage (cache, runStart) == NULL) {
+				return false;
+			}
+			runStart = runEnd;
+			continue;
+		}
+
+		if (!_FAT_disc_readSectors (cache->disc, runStart, runEnd - runStart, buffer)) {
+			return false;
+		}
+
+		for (page = runStart; page < runEnd; page += sectorsPerPage) {
+			entry = _FAT_cache_claimPage (cache);
+			if (entry == NULL) {
+				return false;
+			}
+			entry->sector = page;
+			entry->count = (runEnd - page < sectorsPerPage) ? runEnd - page : sectorsPerPage;
+			entry->last_access = accessTime(cache);
+			memcpy (entry->cache, buffer + (page - runStart) * cache->bytesPerSector, entry->count * cache->bytesPerSector);
+		}
+
+		runStart = runEnd;
+	}
+
+	return true;
+}
+
+bool _FAT_cache_flushSectors (CACHE* cache, sec_t sector, sec_t numSectors) {
+	unsigned int i;
+	CACHE_ENTRY* entry;
+
+	for (i = 0; i < cache->numberOfPages; i++) {
+		entry = &cache->cacheEntries[i];
+		if (!entry->dirty || (entry->sector + entry->count <= sector) || (entry->sector >= sector + numSectors)) {
+			continue;
+		}
+		if (!_FAT_disc_writeSectors (cache->disc, entry->sector, entry->count, entry->cache)) {
+			return false;
+		}
+		entry->dirty = false;
+	}
+
+	return true;
+}
+
+bool _FAT_cache_flushOwner (CACHE* cache, const void* owner, sec_t skipSector, sec_t skipCount) {
+	unsigned int i;
+	CACHE_ENTRY* entry;
+
+	for (i = 0; i < cache->numberOfPages; i++) {
+		entry = &cache->cacheEntries[i];
+		if (!entry->dirty) {
+			continue;
+		}
+		if ((entry->owner != owner) && (entry->owner != NULL) && (entry->owner != CACHE_OWNER_SHARED)) {
+			continue;
+		}
+		if ((entry->sector < skipSector + skipCount) && (entry->sector + entry->count > skipSector)) {
+			continue;
+		}
+		if (!_FAT_disc_writeSectors (cache->disc, entry->sector, entry->count, entry->cache)) {
+			return false;
+		}
+		entry->dirty = false;
+	}
+
+	return true;
+}
+
 void _FAT_cache_invalidate (CACHE* cache) {
 	unsigned int i;
 	_FAT_cache_flush(cache);
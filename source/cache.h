@@ -39,11 +39,15 @@
 #include "common.h"
 #include "disc.h"
 
+// The owner of a page dirtied by more than one owner
+#define CACHE_OWNER_SHARED ((const void*)1)
+
 typedef struct {
 	sec_t        sector;
 	unsigned int count;
 	unsigned int last_access;
 	bool         dirty;
+	const void*  owner;			// What dirtied the page: a file, NULL for metadata, or CACHE_OWNER_SHARED
 	uint8_t*     cache;
 } CACHE_ENTRY;
 
@@ -54,8 +58,24 @@ typedef struct {
 	unsigned int          sectorsPerPage;
 	unsigned int          bytesPerSector;
 	CACHE_ENTRY*          cacheEntries;
+	const uint8_t*        zeroBuffer;		// A page worth of zeros to write from
+	const void*           owner;			// What pages dirtied from now on belong to, NULL for metadata
+	uint8_t*              prefetchBuffer;	// Where _FAT_cache_prefetch gathers runs of pages, allocated when first needed
+	sec_t                 prefetchSectors;	// The size of prefetchBuffer
+	unsigned int          accessCounter;		// Goes up with each access, to date the pages by
 } CACHE;
 
+/*
+Make pages dirtied from now on belong to owner, such as a file whose data is
+being written, or to metadata if owner is NULL.
+Returns the owner set before, to be put back afterwards.
+*/
+static inline const void* _FAT_cache_setOwner (CACHE* cache, const void* owner) {
+	const void* previous = cache->owner;
+	cache->owner = owner;
+	return previous;
+}
+
 /*
 Read data from a sector in the cache
 If the sector is not in the cache, it will be swapped in
@@ -67,6 +87,14 @@ bool _FAT_cache_readPartialSector (CACHE* cache, void* buffer, sec_t sector, uns
 
 bool _FAT_cache_readLittleEndianValue (CACHE* cache, uint32_t *value, sec_t sector, unsigned int offset, int num_bytes);
 
+/*
+Get a pointer to the data of a sector in the cache
+If the sector is not in the cache, it will be swapped in
+The pointer is only valid until the next call to any other cache function
+Returns NULL on failure
+*/
+const uint8_t* _FAT_cache_peekSector (CACHE* cache, sec_t sector);
+
 /*
 Write data to a sector in the cache
 If the sector is not in the cache, it will be swapped in.
@@ -79,6 +107,15 @@ bool _FAT_cache_writePartialSector (CACHE* cache, const void* buffer, sec_t sect
 
 bool _FAT_cache_writeLittleEndianValue (CACHE* cache, const uint32_t value, sec_t sector, unsigned int offset, int num_bytes);
 
+/*
+Get a pointer to the data of a sector in the cache, for modifying in place
+If the sector is not in the cache, it will be swapped in
+The page is marked dirty, so the changes will be written to disc when it is swapped out
+The pointer is only valid until the next call to any other cache function
+Returns NULL on failure
+*/
+uint8_t* _FAT_cache_modifySector (CACHE* cache, sec_t sector);
+
 /*
 Write data to a sector in the cache, zeroing the sector first
 If the sector is not in the cache, it will be swapped in.
@@ -110,11 +147,48 @@ static inline bool _FAT_cache_writeSector (CACHE* cache, const void* buffer, sec
 
 bool _FAT_cache_writeSectors (CACHE* cache, sec_t sector, sec_t numSectors, const void* buffer);
 
+/*
+Copy sectors that have been written straight to disc into any cached pages
+that hold them, so that the stale copies are never written back over them
+*/
+void _FAT_cache_updateSectors (CACHE* cache, sec_t sector, sec_t numSectors, const void* buffer);
+
+/*
+Fill numSectors sectors, starting at sector, with zeros.
+Less than a page is written through the cache. More than that is written
+straight to the disc, using the disc's own zeroing if it has it, and any
+cached copies of the sectors are zeroed to match.
+*/
+bool _FAT_cache_zeroSectors (CACHE* cache, sec_t sector, sec_t numSectors);
+
 /*
 Write any dirty sectors back to disc and clear out the contents of the cache
 */
 bool _FAT_cache_flush (CACHE* cache);
 
+/*
+Load the pages that hold sectors from sector to sector + numSectors - 1 ahead of
+them being used. Runs of pages that aren't already cached are read from the disc
+together, up to half the cache at a time, into a buffer the cache keeps for it.
+If there isn't the memory for that buffer, the runs are shorter, down to a page
+at a time.
+Returns false if they couldn't be read.
+*/
+bool _FAT_cache_prefetch (CACHE* cache, sec_t sector, sec_t numSectors);
+
+/*
+Write back any dirty pages that hold sectors from sector to sector + numSectors - 1,
+leaving them in the cache
+*/
+bool _FAT_cache_flushSectors (CACHE* cache, sec_t sector, sec_t numSectors);
+
+/*
+Write back the dirty pages that belong to owner, to metadata, or to more than one
+owner, leaving them in the cache. Pages that only another owner dirtied are left
+dirty, as are any that hold sectors from skipSector to skipSector + skipCount - 1.
+*/
+bool _FAT_cache_flushOwner (CACHE* cache, const void* owner, sec_t skipSector, sec_t skipCount);
+
 /*
 Clear out the contents of the cache without writing any dirty sectors first
 */
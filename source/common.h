@@ -61,24 +61,29 @@
 #if   defined (__wii__)
    #define DEFAULT_CACHE_PAGES 4
    #define DEFAULT_SECTORS_PAGE 64
+   #define DELAYED_ALLOC_BYTES (128 * 1024)
    #define USE_LWP_LOCK
    #define USE_RTC_TIME
 #elif defined (__gamecube__)
    #define DEFAULT_CACHE_PAGES 4
    #define DEFAULT_SECTORS_PAGE 64
+   #define DELAYED_ALLOC_BYTES (128 * 1024)
    #define USE_LWP_LOCK
    #define USE_RTC_TIME
 #elif defined (NDS)
    #define DEFAULT_CACHE_PAGES 16
    #define DEFAULT_SECTORS_PAGE 8
+   #define DELAYED_ALLOC_BYTES (32 * 1024)
    #define USE_RTC_TIME
 #elif defined (GBA)
    #define DEFAULT_CACHE_PAGES 2
    #define DEFAULT_SECTORS_PAGE 8
+   #define DELAYED_ALLOC_BYTES (4 * 1024)
    #define LIMIT_SECTORS 128
 #elif defined (GP2X)
   #define DEFAULT_CACHE_PAGES 16
   #define DEFAULT_SECTORS_PAGE 8
+  #define DELAYED_ALLOC_BYTES (64 * 1024)
 #endif
 
 #endif // _COMMON_H
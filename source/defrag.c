@@ -0,0 +1,524 @@
+/*
+ defrag.c
+ Moving the clusters of files on a mounted partition so that each
+ file is stored contiguously
+
+ Copyright (c) 2006 Michael "Chishm" Chisholm
+
+ Redistribution and use in source and binary forms, with or without modification,
+ are permitted provided that the following conditions are met:
+
+  1. Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+  2. Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation and/or
+     other materials provided with the distribution.
+  3. The name of the author may not be used to endorse or promote products derived
+     from this software without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY
+ AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE
+ LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "defrag.h"
+
+#include <string.h>
+#include <errno.h>
+
+#include "cache.h"
+#include "fatfile.h"
+#include "file_allocation_table.h"
+#include "mem_allocate.h"
+#include "bit_ops.h"
+#include "lock.h"
+
+static inline bool _FAT_defrag_samePosition (const DIR_ENTRY_POSITION* a, const DIR_ENTRY_POSITION* b) {
+	return (a->cluster == b->cluster) && (a->sector == b->sector) && (a->offset == b->offset);
+}
+
+static bool _FAT_defrag_readEntry (PARTITION* partition, const DIR_ENTRY_POSITION* entryEnd, uint8_t* entryData) {
+	return _FAT_cache_readPartialSector (partition->cache, entryData,
+		_FAT_fat_clusterToSector (partition, entryEnd->cluster) + entryEnd->sector,
+		entryEnd->offset * DIR_ENTRY_DATA_SIZE, DIR_ENTRY_DATA_SIZE);
+}
+
+static bool _FAT_defrag_writeEntry (PARTITION* partition, const DIR_ENTRY_POSITION* entryEnd, const uint8_t* entryData) {
+	return _FAT_cache_writePartialSector (partition->cache, entryData,
+		_FAT_fat_clusterToSector (partition, entryEnd->cluster) + entryEnd->sector,
+		entryEnd->offset * DIR_ENTRY_DATA_SIZE, DIR_ENTRY_DATA_SIZE);
+}
+
+/*
+Find an open file using the directory entry at entryEnd
+*/
+static FILE_STRUCT* _FAT_defrag_findOpenFile (PARTITION* partition, const DIR_ENTRY_POSITION* entryEnd) {
+	FILE_STRUCT* file;
+
+	for (file = partition->firstOpenFile; file != NULL; file = file->nextOpenFile) {
+		if (file->inUse && _FAT_defrag_samePosition (&file->dirEntryEnd, entryEnd)) {
+			return file;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+Point every open copy of the file at newCluster wherever it used oldCluster
+*/
+static void _FAT_defrag_remapOpenFiles (PARTITION* partition, const DIR_ENTRY_POSITION* entryEnd, uint32_t oldCluster, uint32_t newCluster) {
+	FILE_STRUCT* file;
+
+	for (file = partition->firstOpenFile; file != NULL; file = file->nextOpenFile) {
+		if (!file->inUse || !_FAT_defrag_samePosition (&file->dirEntryEnd, entryEnd)) {
+			continue;
+		}
+		if (file->startCluster == oldCluster) {
+			file->startCluster = newCluster;
+		}
+		if (file->rwPosition.cluster == oldCluster) {
+			file->rwPosition.cluster = newCluster;
+		}
+		if (file->appendPosition.cluster == oldCluster) {
+			file->appendPosition.cluster = newCluster;
+		}
+		if (file->hintPosition.cluster == oldCluster) {
+			file->hintPosition.cluster = newCluster;
+		}
+	}
+}
+
+static bool _FAT_defrag_copyCluster (PARTITION* partition, uint32_t fromCluster, uint32_t toCluster, uint8_t* buffer, uint32_t bufferSectors) {
+	sec_t fromSector = _FAT_fat_clusterToSector (partition, fromCluster);
+	sec_t toSector = _FAT_fat_clusterToSector (partition, toCluster);
+	uint32_t done, count;
+
+	for (done = 0; done < partition->sectorsPerCluster; done += count) {
+		count = partition->sectorsPerCluster - done;
+		if (count > bufferSectors) {
+			count = bufferSectors;
+		}
+		if (!_FAT_cache_readSectors (partition->cache, fromSector + done, count, buffer) ||
+			!_FAT_cache_writeSectors (partition->cache, toSector + done, count, buffer))
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/*
+Move one run of a file's clusters into free space, so that more of the file
+is contiguous from its start.
+The new clusters are written and linked to the rest of the file before the
+file is switched over to them, and the old clusters are only freed after
+that, with the cache flushed between each stage. If the disc is removed part
+way through, the file is intact and at worst some clusters are lost.
+*/
+static DEFRAG_RESULT _FAT_defrag_step (PARTITION* partition, const DIR_ENTRY_POSITION* entryEnd, uint32_t* budget,
+	uint8_t* buffer, uint32_t bufferSectors)
+{
+	uint8_t entryData[DIR_ENTRY_DATA_SIZE];
+	FILE_STRUCT* file;
+	uint32_t maxLinks = partition->fat.lastCluster - CLUSTER_FIRST;
+	uint32_t startCluster;
+	uint32_t prefixEnd, prefixLength;
+	uint32_t chainLength;
+	uint32_t tailCluster, nextCluster;
+	uint32_t previousCluster, firstMoved, lastMoved;
+	uint32_t destCluster, moveCount, remaining;
+	uint32_t i;
+	bool switched;
+
+	if (!_FAT_defrag_readEntry (partition, entryEnd, entryData)) {
+		return DEFRAG_ERROR;
+	}
+	if ((entryData[0] == DIR_ENTRY_FREE) || (entryData[0] == DIR_ENTRY_LAST) ||
+		(entryData[DIR_ENTRY_attributes] & (ATTRIB_DIR | ATTRIB_VOL)))
+	{
+		// Not a file any more
+		return DEFRAG_DONE;
+	}
+
+	// An open file may have changed its clusters without updating the entry yet
+	file = _FAT_defrag_findOpenFile (partition, entryEnd);
+	startCluster = file ? file->startCluster : _FAT_directory_entryGetCluster (partition, entryData);
+	if (!_FAT_fat_isValidCluster (partition, startCluster)) {
+		return DEFRAG_DONE;
+	}
+
+	// Work out how much of the file is already in one piece
+	prefixEnd = startCluster;
+	prefixLength = _FAT_fat_followChain (partition, &prefixEnd, &nextCluster, maxLinks, true) + 1;
+	if (nextCluster == CLUSTER_ERROR) {
+		return DEFRAG_ERROR;
+	}
+	if (!_FAT_fat_isValidCluster (partition, nextCluster)) {
+		return DEFRAG_DONE;
+	}
+
+	tailCluster = nextCluster;
+	chainLength = prefixLength + 1 + _FAT_fat_followChain (partition, &tailCluster, &nextCluster, maxLinks, false);
+	remaining = chainLength - prefixLength;
+
+	if (_FAT_fat_freeRunLength (partition, prefixEnd + 1, remaining) == remaining) {
+		// The rest of the file fits straight after the part that is in one piece
+		destCluster = prefixEnd + 1;
+		previousCluster = prefixEnd;
+		firstMoved = _FAT_fat_nextCluster (partition, prefixEnd);
+		moveCount = remaining;
+	} else {
+		// Move the whole file somewhere it will fit in one piece
+		destCluster = _FAT_fat_findFreeExtent (partition, CLUSTER_FIRST, chainLength);
+		if (destCluster == CLUSTER_ERROR) {
+			return DEFRAG_NO_SPACE;
+		}
+		previousCluster = CLUSTER_FREE;
+		firstMoved = startCluster;
+		moveCount = chainLength;
+	}
+
+	if (moveCount > *budget) {
+		moveCount = *budget;
+	}
+	if (moveCount == 0) {
+		return DEFRAG_MORE;
+	}
+
+	// Copy the data into the new clusters
+	lastMoved = firstMoved;
+	for (i = 0; i < moveCount; i++) {
+		if (i > 0) {
+			lastMoved = _FAT_fat_nextCluster (partition, lastMoved);
+		}
+		if (!_FAT_fat_isValidCluster (partition, lastMoved) ||
+			!_FAT_defrag_copyCluster (partition, lastMoved, destCluster + i, buffer, bufferSectors))
+		{
+			return DEFRAG_ERROR;
+		}
+	}
+
+	// Link the new clusters to the rest of the file, and make sure it is all on disc
+	// before the file starts using them
+	nextCluster = _FAT_fat_nextCluster (partition, lastMoved);
+	if (!_FAT_fat_allocateRun (partition, destCluster, moveCount, nextCluster) ||
+		!_FAT_partition_flush (partition))
+	{
+		return DEFRAG_ERROR;
+	}
+
+	// Switch the file over to the new clusters
+	if (previousCluster != CLUSTER_FREE) {
+		switched = _FAT_fat_setLink (partition, previousCluster, destCluster);
+	} else {
+		u16_to_u8array (entryData, DIR_ENTRY_cluster, destCluster);
+		u16_to_u8array (entryData, DIR_ENTRY_clusterHigh, destCluster >> 16);
+		switched = _FAT_defrag_writeEntry (partition, entryEnd, entryData);
+	}
+	if (!switched || !_FAT_partition_flush (partition)) {
+		return DEFRAG_ERROR;
+	}
+
+	// The old clusters still lead to the rest of the file, so use them to update open files
+	tailCluster = firstMoved;
+	for (i = 0; i < moveCount; i++) {
+		if (i > 0) {
+			tailCluster = _FAT_fat_nextCluster (partition, tailCluster);
+		}
+		_FAT_defrag_remapOpenFiles (partition, entryEnd, tailCluster, destCluster + i);
+	}
+
+	// Cut the old clusters off from the rest of the file and free them
+	if (!_FAT_fat_setLink (partition, lastMoved, CLUSTER_EOF) ||
+		!_FAT_fat_clearLinks (partition, firstMoved) ||
+		!_FAT_partition_flush (partition))
+	{
+		return DEFRAG_ERROR;
+	}
+
+	*budget -= moveCount;
+	return DEFRAG_MORE;
+}
+
+/*
+Allocate a buffer for copying clusters. *bufferSectors is set to its size.
+*/
+static uint8_t* _FAT_defrag_allocBuffer (PARTITION* partition, uint32_t* bufferSectors) {
+	uint32_t sectors = partition->sectorsPerCluster;
+
+#ifdef LIMIT_SECTORS
+	if (sectors > LIMIT_SECTORS) {
+		sectors = LIMIT_SECTORS;
+	}
+#endif
+
+	*bufferSectors = sectors;
+	return (uint8_t*) _FAT_mem_align (sectors * partition->bytesPerSector);
+}
+
+static DEFRAG_RESULT _FAT_defrag_fileWithBuffer (PARTITION* partition, const DIR_ENTRY_POSITION* entryEnd, uint32_t* budget,
+	uint8_t* buffer, uint32_t bufferSectors)
+{
+	DEFRAG_RESULT result;
+
+	do {
+		result = _FAT_defrag_step (partition, entryEnd, budget, buffer, bufferSectors);
+	} while ((result == DEFRAG_MORE) && (*budget > 0));
+
+	return result;
+}
+
+DEFRAG_RESULT _FAT_defrag_file (PARTITION* partition, const DIR_ENTRY_POSITION* entryEnd, uint32_t* budget) {
+	DEFRAG_RESULT result;
+	uint32_t bufferSectors;
+	uint8_t* buffer;
+
+	buffer = _FAT_defrag_allocBuffer (partition, &bufferSectors);
+	if (buffer == NULL) {
+		return DEFRAG_ERROR;
+	}
+
+	result = _FAT_defrag_fileWithBuffer (partition, entryEnd, budget, buffer, bufferSectors);
+
+	_FAT_mem_free (buffer);
+	return result;
+}
+
+void _FAT_defrag_freeState (DEFRAG_STATE* state) {
+	_FAT_mem_free (state->levels);
+	_FAT_mem_free (state);
+}
+
+/*
+Start on the directory at dirCluster, making room for it if the state has none
+left at that depth. Returns false if there's no memory for it.
+*/
+static bool _FAT_defrag_enterDirectory (DEFRAG_STATE* state, unsigned int depth, uint32_t dirCluster) {
+	DEFRAG_LEVEL* levels;
+
+	if (depth >= state->capacity) {
+		levels = (DEFRAG_LEVEL*) _FAT_mem_allocate ((state->capacity + DEFRAG_DEPTH_STEP) * sizeof(DEFRAG_LEVEL));
+		if (levels == NULL) {
+			return false;
+		}
+		if (state->levels) {
+			memcpy (levels, state->levels, state->capacity * sizeof(DEFRAG_LEVEL));
+			_FAT_mem_free (state->levels);
+		}
+		state->levels = levels;
+		state->capacity += DEFRAG_DEPTH_STEP;
+	}
+
+	state->depth = depth;
+	state->levels[depth].dirCluster = dirCluster;
+	state->levels[depth].position.cluster = dirCluster;
+	state->levels[depth].position.sector = 0;
+	state->levels[depth].position.offset = -1;	// Start before the beginning of the directory
+	return true;
+}
+
+/*
+Make sure the directories the saved state is part way through haven't been
+removed since the last call
+*/
+static bool _FAT_defrag_stateValid (PARTITION* partition, DEFRAG_STATE* state) {
+	uint8_t entryData[DIR_ENTRY_DATA_SIZE];
+	unsigned int i;
+
+	for (i = 1; i <= state->depth; i++) {
+		if (!_FAT_defrag_readEntry (partition, &state->levels[i - 1].position, entryData) ||
+			(entryData[0] == DIR_ENTRY_FREE) || (entryData[0] == DIR_ENTRY_LAST) ||
+			!(entryData[DIR_ENTRY_attributes] & ATTRIB_DIR) ||
+			(_FAT_directory_entryGetCluster (partition, entryData) != state->levels[i].dirCluster))
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+DEFRAG_RESULT _FAT_defrag_volume (PARTITION* partition, uint32_t budget) {
+	DEFRAG_STATE* state = partition->defragState;
+	DEFRAG_RESULT result = DEFRAG_MORE;
+	DIR_ENTRY entry;
+	uint32_t dirCluster;
+	uint32_t bufferSectors;
+	uint8_t* buffer;
+
+	if (state == NULL) {
+		state = (DEFRAG_STATE*) _FAT_mem_allocate (sizeof(DEFRAG_STATE));
+		if (state == NULL) {
+			return DEFRAG_ERROR;
+		}
+		state->capacity = 0;
+		state->levels = NULL;
+		if (!_FAT_defrag_enterDirectory (state, 0, partition->rootDirCluster)) {
+			_FAT_defrag_freeState (state);
+			return DEFRAG_ERROR;
+		}
+		partition->defragState = state;
+	} else if (!_FAT_defrag_stateValid (partition, state)) {
+		// Part of the tree has gone, so start again from the top
+		_FAT_defrag_enterDirectory (state, 0, partition->rootDirCluster);
+	}
+
+	buffer = _FAT_defrag_allocBuffer (partition, &bufferSectors);
+	if (buffer == NULL) {
+		return DEFRAG_ERROR;
+	}
+
+	while (budget > 0) {
+		entry.dataEnd = state->levels[state->depth].position;
+		if (!_FAT_directory_getNextEntry (partition, &entry)) {
+			if (state->depth == 0) {
+				// Every file has been done
+				result = DEFRAG_DONE;
+				break;
+			}
+			// Carry on in the parent directory
+			state->depth--;
+			continue;
+		}
+
+		if (_FAT_directory_isDirectory (&entry)) {
+			dirCluster = _FAT_directory_entryGetCluster (partition, entry.entryData);
+			if (!_FAT_directory_isDot (&entry) && _FAT_fat_isValidCluster (partition, dirCluster)) {
+				if (state->depth + 1 >= DEFRAG_MAX_DEPTH) {
+					// Rather than report a volume done that never was
+					result = DEFRAG_ERROR;
+					break;
+				}
+				state->levels[state->depth].position = entry.dataEnd;
+				if (!_FAT_defrag_enterDirectory (state, state->depth + 1, dirCluster)) {
+					// The parent has already moved past this directory, so start over rather than skip it
+					_FAT_defrag_enterDirectory (state, 0, partition->rootDirCluster);
+					result = DEFRAG_ERROR;
+					break;
+				}
+				continue;
+			}
+		} else {
+			result = _FAT_defrag_fileWithBuffer (partition, &entry.dataEnd, &budget, buffer, bufferSectors);
+			if (result == DEFRAG_ERROR) {
+				break;
+			}
+			if (result == DEFRAG_MORE) {
+				// Out of budget part way through, so come back to this file next time
+				break;
+			}
+			// A file that won't fit anywhere in one piece is left as it is
+			result = DEFRAG_MORE;
+		}
+
+		state->levels[state->depth].position = entry.dataEnd;
+	}
+
+	_FAT_mem_free (buffer);
+
+	if (result == DEFRAG_DONE) {
+		_FAT_defrag_freeState (partition->defragState);
+		partition->defragState = NULL;
+	}
+
+	return result;
+}
+
+int fatDefragFile (const char* path) {
+	PARTITION* partition;
+	DIR_ENTRY dirEntry;
+	DEFRAG_RESULT result;
+	uint32_t budget = UINT32_MAX;
+
+	partition = _FAT_partition_getPartitionFromPath (path);
+	if (partition == NULL) {
+		errno = ENODEV;
+		return -1;
+	}
+
+	// Move the path pointer to the start of the actual path
+	if (strchr (path, ':') != NULL) {
+		path = strchr (path, ':') + 1;
+	}
+	if (strchr (path, ':') != NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (partition->readOnly) {
+		errno = EROFS;
+		return -1;
+	}
+
+	_FAT_lock(&partition->lock);
+
+	// Reads going on with the partition unlocked could be part way through the
+	// clusters about to be moved, and would put back positions in them afterwards
+	_FAT_partition_waitForTransfers (partition);
+
+	if (!_FAT_directory_entryFromPath (partition, &dirEntry, path, NULL)) {
+		_FAT_unlock(&partition->lock);
+		errno = ENOENT;
+		return -1;
+	}
+
+	if (_FAT_directory_isDirectory (&dirEntry)) {
+		_FAT_unlock(&partition->lock);
+		errno = EISDIR;
+		return -1;
+	}
+
+	result = _FAT_defrag_file (partition, &dirEntry.dataEnd, &budget);
+
+	_FAT_unlock(&partition->lock);
+
+	if (result == DEFRAG_ERROR) {
+		errno = EIO;
+		return -1;
+	} else if (result == DEFRAG_NO_SPACE) {
+		errno = ENOSPC;
+		return -1;
+	}
+
+	return 0;
+}
+
+int fatDefragVolume (const char* name, uint32_t budget) {
+	PARTITION* partition;
+	DEFRAG_RESULT result;
+
+	partition = _FAT_partition_getPartitionFromPath (name);
+	if (partition == NULL) {
+		errno = ENODEV;
+		return -1;
+	}
+
+	if (partition->readOnly) {
+		errno = EROFS;
+		return -1;
+	}
+
+	if (budget == 0) {
+		budget = UINT32_MAX;
+	}
+
+	_FAT_lock(&partition->lock);
+	_FAT_partition_waitForTransfers (partition);
+	result = _FAT_defrag_volume (partition, budget);
+	_FAT_unlock(&partition->lock);
+
+	if (result == DEFRAG_ERROR) {
+		errno = EIO;
+		return -1;
+	}
+
+	return (result == DEFRAG_DONE) ? 1 : 0;
+}
@@ -0,0 +1,81 @@
+/*
+ defrag.h
+ Moving the clusters of files on a mounted partition so that each
+ file is stored contiguously
+
+ Copyright (c) 2006 Michael "Chishm" Chisholm
+
+ Redistribution and use in source and binary forms, with or without modification,
+ are permitted provided that the following conditions are met:
+
+  1. Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+  2. Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation and/or
+     other materials provided with the distribution.
+  3. The name of the author may not be used to endorse or promote products derived
+     from this software without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY
+ AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE
+ LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef _DEFRAG_H
+#define _DEFRAG_H
+
+#include "common.h"
+#include "partition.h"
+#include "directory.h"
+
+// Directory levels to make room for at a time
+#define DEFRAG_DEPTH_STEP 16
+// No path can name anything deeper, so only a directory tree that loops back on itself goes further
+#define DEFRAG_MAX_DEPTH (PATH_MAX / 2)
+
+typedef enum {DEFRAG_ERROR, DEFRAG_DONE, DEFRAG_MORE, DEFRAG_NO_SPACE} DEFRAG_RESULT;
+
+typedef struct {
+	uint32_t           dirCluster;
+	DIR_ENTRY_POSITION position;		// The last entry dealt with in this directory
+} DEFRAG_LEVEL;
+
+/*
+Where fatDefragVolume got to, so that the next call can carry on from there.
+levels[i] is the directory at depth i, with room for capacity levels.
+*/
+struct _DEFRAG_STATE {
+	unsigned int       depth;
+	unsigned int       capacity;
+	DEFRAG_LEVEL*      levels;
+};
+
+typedef struct _DEFRAG_STATE DEFRAG_STATE;
+
+/*
+Move the clusters of the file whose alias entry is at entryEnd so that
+they are contiguous, moving no more than *budget clusters. *budget is
+reduced by the number of clusters moved.
+Does no locking of its own -- lock the partition before calling.
+*/
+DEFRAG_RESULT _FAT_defrag_file (PARTITION* partition, const DIR_ENTRY_POSITION* entryEnd, uint32_t* budget);
+
+/*
+Carry on defragmenting every file on the partition, moving no more than
+budget clusters before returning.
+Does no locking of its own -- lock the partition before calling.
+*/
+DEFRAG_RESULT _FAT_defrag_volume (PARTITION* partition, uint32_t budget);
+
+/*
+Free a state left by a volume defrag that never finished
+*/
+void _FAT_defrag_freeState (DEFRAG_STATE* state);
+
+#endif // _DEFRAG_H
@@ -41,10 +41,6 @@
 #include "bit_ops.h"
 #include "filetime.h"
 
-// Directory entry codes
-#define DIR_ENTRY_LAST 0x00
-#define DIR_ENTRY_FREE 0xE5
-
 typedef unsigned short ucs2_t;
 
 // Long file name directory entry
@@ -266,7 +262,7 @@ static bool _FAT_directory_incrementDirEntryPosition (PARTITION* partition, DIR_
 			tempCluster = _FAT_fat_nextCluster(partition, position.cluster);
 			if (tempCluster == CLUSTER_EOF) {
 				if (extendDirectory) {
-					tempCluster = _FAT_fat_linkFreeClusterCleared (partition, position.cluster);
+					tempCluster = _FAT_fat_linkFreeClusterCleared (partition, position.cluster, CLUSTER_FREE);
 					if (!_FAT_fat_isValidCluster(partition, tempCluster)) {
 						return false;	// This will only happen if the disc is full
 					}
@@ -92,6 +92,10 @@ enum DIR_ENTRY_offset {
 	DIR_ENTRY_fileSize = 0x1C
 };
 
+// Directory entry codes
+#define DIR_ENTRY_LAST 0x00
+#define DIR_ENTRY_FREE 0xE5
+
 /*
 Returns true if the file specified by entry is a directory
 */
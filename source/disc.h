@@ -107,4 +107,41 @@ static inline uint32_t _FAT_disc_features (const DISC_INTERFACE* disc) {
 	return disc->features;
 }
 
+/*
+Return true if the disc can discard sectors
+*/
+static inline bool _FAT_disc_canDiscard (const DISC_INTERFACE* disc) {
+	return (disc->features & FEATURE_MEDIUM_CANDISCARD) != 0;
+}
+
+/*
+Tell the disc that numSectors sectors, starting at sector, no longer hold
+anything that will be read. Only call this if _FAT_disc_canDiscard is true.
+*/
+static inline bool _FAT_disc_discardSectors (const DISC_INTERFACE* disc, sec_t sector, sec_t numSectors) {
+	return ((const DISC_INTERFACE_EX*)disc)->discardSectors (sector, numSectors);
+}
+
+/*
+Return true if the disc can fill sectors with zeros itself
+*/
+static inline bool _FAT_disc_canZero (const DISC_INTERFACE* disc) {
+	return (disc->features & FEATURE_MEDIUM_CANZERO) != 0;
+}
+
+/*
+Fill numSectors sectors, starting at sector, with zeros. Only call this if
+_FAT_disc_canZero is true.
+*/
+static inline bool _FAT_disc_zeroSectors (const DISC_INTERFACE* disc, sec_t sector, sec_t numSectors) {
+	return ((const DISC_INTERFACE_EX*)disc)->zeroSectors (sector, numSectors);
+}
+
+/*
+Return true if the disc can be read and written by more than one thread at once
+*/
+static inline bool _FAT_disc_isReentrant (const DISC_INTERFACE* disc) {
+	return (disc->features & FEATURE_MEDIUM_REENTRANT) != 0;
+}
+
 #endif // _DISC_H
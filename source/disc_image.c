@@ -0,0 +1,147 @@
+/*
+ disc_image.c
+ A disc interface that uses a disc image file on a Linux host, so
+ that libfat can be tried out and tested away from the hardware
+
+ Copyright (c) 2006 Michael "Chishm" Chisholm
+
+ Redistribution and use in source and binary forms, with or without modification,
+ are permitted provided that the following conditions are met:
+
+  1. Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+  2. Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation and/or
+     other materials provided with the distribution.
+  3. The name of the author may not be used to endorse or promote products derived
+     from this software without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY
+ AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE
+ LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+#ifdef LIBFAT_DISC_IMAGE
+#define _GNU_SOURCE		// For fallocate
+#endif
+
+#include "common.h"
+
+#ifdef LIBFAT_DISC_IMAGE
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <linux/falloc.h>
+
+#define IMAGE_SECTOR_SIZE 512
+
+static int imageFile = -1;
+
+// Set by fatImageSetLatency
+static uint32_t requestLatency = 0;
+static uint32_t sectorLatency = 0;
+
+static void _FAT_image_delay (sec_t numSectors) {
+	uint64_t us = requestLatency + (uint64_t)numSectors * sectorLatency;
+	struct timespec delay;
+
+	if (us > 0) {
+		delay.tv_sec = us / 1000000;
+		delay.tv_nsec = (us % 1000000) * 1000;
+		nanosleep (&delay, NULL);
+	}
+}
+
+static bool _FAT_image_startup (void) {
+	return imageFile >= 0;
+}
+
+static bool _FAT_image_isInserted (void) {
+	return imageFile >= 0;
+}
+
+static bool _FAT_image_readSectors (sec_t sector, sec_t numSectors, void* buffer) {
+	size_t size = (size_t)numSectors * IMAGE_SECTOR_SIZE;
+	_FAT_image_delay (numSectors);
+	return pread (imageFile, buffer, size, (off_t)sector * IMAGE_SECTOR_SIZE) == (ssize_t)size;
+}
+
+static bool _FAT_image_writeSectors (sec_t sector, sec_t numSectors, const void* buffer) {
+	size_t size = (size_t)numSectors * IMAGE_SECTOR_SIZE;
+	_FAT_image_delay (numSectors);
+	return pwrite (imageFile, buffer, size, (off_t)sector * IMAGE_SECTOR_SIZE) == (ssize_t)size;
+}
+
+static bool _FAT_image_clearStatus (void) {
+	return true;
+}
+
+static bool _FAT_image_shutdown (void) {
+	if (imageFile >= 0) {
+		close (imageFile);
+		imageFile = -1;
+	}
+	return true;
+}
+
+/*
+Discarded sectors are punched out of the image, so the file takes up less
+space on the host and the sectors read back as zeros
+*/
+static bool _FAT_image_discardSectors (sec_t sector, sec_t numSectors) {
+	return fallocate (imageFile, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+		(off_t)sector * IMAGE_SECTOR_SIZE, (off_t)numSectors * IMAGE_SECTOR_SIZE) == 0;
+}
+
+static bool _FAT_image_zeroSectors (sec_t sector, sec_t numSectors) {
+	return fallocate (imageFile, FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE,
+		(off_t)sector * IMAGE_SECTOR_SIZE, (off_t)numSectors * IMAGE_SECTOR_SIZE) == 0;
+}
+
+static DISC_INTERFACE_EX _FAT_image_interface = {
+	{
+		0x474D4946,		// "FIMG"
+		FEATURE_MEDIUM_CANREAD | FEATURE_MEDIUM_CANWRITE | FEATURE_MEDIUM_CANDISCARD | FEATURE_MEDIUM_CANZERO |
+			FEATURE_MEDIUM_REENTRANT,
+		_FAT_image_startup,
+		_FAT_image_isInserted,
+		_FAT_image_readSectors,
+		_FAT_image_writeSectors,
+		_FAT_image_clearStatus,
+		_FAT_image_shutdown
+	},
+	_FAT_image_discardSectors,
+	_FAT_image_zeroSectors
+};
+
+const DISC_INTERFACE* fatImageInterface (const char* path, bool writable) {
+	_FAT_image_shutdown ();
+
+	imageFile = open (path, writable ? O_RDWR : O_RDONLY);
+	if (imageFile < 0) {
+		return NULL;
+	}
+
+	if (writable) {
+		_FAT_image_interface.interface.features |= FEATURE_MEDIUM_CANWRITE;
+	} else {
+		_FAT_image_interface.interface.features &= ~FEATURE_MEDIUM_CANWRITE;
+	}
+
+	return &_FAT_image_interface.interface;
+}
+
+void fatImageSetLatency (uint32_t requestUs, uint32_t sectorUs) {
+	requestLatency = requestUs;
+	sectorLatency = sectorUs;
+}
+
+#endif // LIBFAT_DISC_IMAGE
@@ -0,0 +1,176 @@
+/*
+ discard.c
+ Telling the disc which sectors are no longer used by any file,
+ so that flash media can erase them ahead of time
+
+ Copyright (c) 2006 Michael "Chishm" Chisholm
+
+ Redistribution and use in source and binary forms, with or without modification,
+ are permitted provided that the following conditions are met:
+
+  1. Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+  2. Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation and/or
+     other materials provided with the distribution.
+  3. The name of the author may not be used to endorse or promote products derived
+     from this software without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY
+ AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE
+ LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+#include "discard.h"
+
+#include <string.h>
+
+#include "disc.h"
+#include "file_allocation_table.h"
+#include "mem_allocate.h"
+
+bool _FAT_discard_init (PARTITION* partition) {
+	partition->discard = NULL;
+
+	if (!_FAT_disc_canDiscard (partition->disc)) {
+		return true;
+	}
+
+	partition->discard = (DISCARD_LIST*) _FAT_mem_allocate (sizeof(DISCARD_LIST));
+	if (partition->discard == NULL) {
+		return false;
+	}
+
+	partition->discard->extentCount = 0;
+	partition->discard->pendingClusters = 0;
+
+	return true;
+}
+
+void _FAT_discard_deinit (PARTITION* partition) {
+	if (partition->discard) {
+		_FAT_mem_free (partition->discard);
+		partition->discard = NULL;
+	}
+}
+
+void _FAT_discard_freed (PARTITION* partition, uint32_t cluster) {
+	DISCARD_LIST* list = partition->discard;
+	DISCARD_EXTENT* extent;
+	unsigned int i;
+
+	if (list == NULL) {
+		return;
+	}
+
+	// Chains are usually freed in order, so most clusters join the latest run
+	for (i = list->extentCount; i > 0; i--) {
+		extent = &list->extents[i - 1];
+		if (extent->firstCluster + extent->count == cluster) {
+			extent->count++;
+			list->pendingClusters++;
+			return;
+		}
+		if (cluster + 1 == extent->firstCluster) {
+			extent->firstCluster = cluster;
+			extent->count++;
+			list->pendingClusters++;
+			return;
+		}
+	}
+
+	if (list->extentCount < DISCARD_EXTENTS) {
+		extent = &list->extents[list->extentCount++];
+		extent->firstCluster = cluster;
+		extent->count = 1;
+		list->pendingClusters++;
+	}
+}
+
+void _FAT_discard_allocated (PARTITION* partition, uint32_t firstCluster, uint32_t count) {
+	DISCARD_LIST* list = partition->discard;
+	DISCARD_EXTENT* extent;
+	uint32_t lastCluster = firstCluster + count;	// One past the end
+	uint32_t extentEnd;
+	unsigned int i;
+
+	if (list == NULL) {
+		return;
+	}
+
+	for (i = 0; i < list->extentCount; i++) {
+		extent = &list->extents[i];
+		extentEnd = extent->firstCluster + extent->count;
+		if ((extentEnd <= firstCluster) || (extent->firstCluster >= lastCluster)) {
+			continue;
+		}
+
+		list->pendingClusters -= extent->count;
+
+		if ((extent->firstCluster < firstCluster) && (extentEnd > lastCluster)) {
+			// Split in two, keeping the larger part if there's no room for both
+			if (list->extentCount < DISCARD_EXTENTS) {
+				list->extents[list->extentCount].firstCluster = lastCluster;
+				list->extents[list->extentCount].count = extentEnd - lastCluster;
+				list->pendingClusters += extentEnd - lastCluster;
+				list->extentCount++;
+				extent->count = firstCluster - extent->firstCluster;
+			} else if (firstCluster - extent->firstCluster >= extentEnd - lastCluster) {
+				extent->count = firstCluster - extent->firstCluster;
+			} else {
+				extent->firstCluster = lastCluster;
+				extent->count = extentEnd - lastCluster;
+			}
+		} else if (extent->firstCluster < firstCluster) {
+			extent->count = firstCluster - extent->firstCluster;
+		} else if (extentEnd > lastCluster) {
+			extent->firstCluster = lastCluster;
+			extent->count = extentEnd - lastCluster;
+		} else {
+			// All of it has been allocated
+			extent->count = 0;
+		}
+
+		list->pendingClusters += extent->count;
+	}
+
+	// Remove the emptied extents
+	for (i = 0; i < list->extentCount; ) {
+		if (list->extents[i].count == 0) {
+			list->extents[i] = list->extents[--list->extentCount];
+		} else {
+			i++;
+		}
+	}
+}
+
+bool _FAT_discard_issue (PARTITION* partition) {
+	DISCARD_LIST* list = partition->discard;
+	bool flagNoError = true;
+	unsigned int i;
+
+	if (list == NULL) {
+		return true;
+	}
+
+	for (i = 0; i < list->extentCount; i++) {
+		if (!_FAT_disc_discardSectors (partition->disc,
+			_FAT_fat_clusterToSector (partition, list->extents[i].firstCluster),
+			list->extents[i].count * partition->sectorsPerCluster))
+		{
+			flagNoError = false;
+		}
+	}
+
+	list->extentCount = 0;
+	list->pendingClusters = 0;
+
+	return flagNoError;
+}
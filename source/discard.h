@@ -0,0 +1,98 @@
+/*
+ discard.h
+ Telling the disc which sectors are no longer used by any file,
+ so that flash media can erase them ahead of time
+
+ Copyright (c) 2006 Michael "Chishm" Chisholm
+
+ Redistribution and use in source and binary forms, with or without modification,
+ are permitted provided that the following conditions are met:
+
+  1. Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+  2. Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation and/or
+     other materials provided with the distribution.
+  3. The name of the author may not be used to endorse or promote products derived
+     from this software without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY
+ AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE
+ LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+#ifndef _DISCARD_H
+#define _DISCARD_H
+
+#include "common.h"
+#include "partition.h"
+
+// Number of separate runs of freed clusters that are remembered
+#define DISCARD_EXTENTS 32
+
+// Discard the freed clusters once this many are waiting
+#define DISCARD_BATCH_CLUSTERS 0x1000
+
+typedef struct {
+	uint32_t firstCluster;
+	uint32_t count;
+} DISCARD_EXTENT;
+
+/*
+Clusters that have been freed but not yet discarded. Clusters that are
+allocated again before then are taken back out.
+*/
+struct _DISCARD_LIST {
+	unsigned int   extentCount;
+	uint32_t       pendingClusters;
+	DISCARD_EXTENT extents[DISCARD_EXTENTS];
+};
+
+typedef struct _DISCARD_LIST DISCARD_LIST;
+
+/*
+Start collecting freed clusters if the partition's disc can discard sectors.
+Returns false if there isn't the memory for it.
+*/
+bool _FAT_discard_init (PARTITION* partition);
+
+/*
+Stop collecting freed clusters, without discarding any still waiting
+*/
+void _FAT_discard_deinit (PARTITION* partition);
+
+/*
+Remember that a cluster has been freed. If there is no room to remember
+it, it just won't be discarded.
+*/
+void _FAT_discard_freed (PARTITION* partition, uint32_t cluster);
+
+/*
+Forget any of the count clusters from firstCluster that were waiting to be
+discarded, now that they have been allocated again
+*/
+void _FAT_discard_allocated (PARTITION* partition, uint32_t firstCluster, uint32_t count);
+
+/*
+Returns true if enough clusters are waiting that they should be discarded
+*/
+static inline bool _FAT_discard_isFull (PARTITION* partition) {
+	return (partition->discard != NULL) &&
+		((partition->discard->extentCount == DISCARD_EXTENTS) || (partition->discard->pendingClusters >= DISCARD_BATCH_CLUSTERS));
+}
+
+/*
+Discard all the waiting clusters. The FAT must already have been written
+to disc, so that no file on the disc still uses them.
+Returns false if the disc failed to discard any of them.
+*/
+bool _FAT_discard_issue (PARTITION* partition);
+
+#endif // _DISCARD_H
@@ -118,6 +118,9 @@ static int _FAT_unlinkCommon (struct _reent *r, const char *path, bool isRmDir)
 
 	_FAT_lock(&partition->lock);
 
+	// The file's clusters may be being read with the partition unlocked
+	_FAT_partition_waitForTransfers (partition);
+
 	// Search for the file on the disc
 	if (!_FAT_directory_entryFromPath (partition, &dirEntry, path, NULL)) {
 		_FAT_unlock(&partition->lock);
@@ -168,7 +171,7 @@ static int _FAT_unlinkCommon (struct _reent *r, const char *path, bool isRmDir)
 	}
 
 	// Flush any sectors in the disc cache
-	if (!_FAT_cache_flush(partition->cache)) {
+	if (!_FAT_partition_flush(partition)) {
 		r->_errno = EIO;
 		errorOccured = true;
 	}
@@ -323,7 +326,7 @@ int _FAT_rename_r (struct _reent *r, const char *oldName, const char *newName) {
 	}
 
 	// Flush any sectors in the disc cache
-	if (!_FAT_cache_flush (partition->cache)) {
+	if (!_FAT_partition_flush (partition)) {
 		_FAT_unlock(&partition->lock);
 		r->_errno = EIO;
 		return -1;
@@ -409,8 +412,8 @@ int _FAT_mkdir_r (struct _reent *r, const char *path, int mode) {
 	// Set the directory attribute
 	dirEntry.entryData[DIR_ENTRY_attributes] = ATTRIB_DIR;
 
-	// Get a cluster for the new directory
-	dirCluster = _FAT_fat_linkFreeClusterCleared (partition, CLUSTER_FREE);
+	// Get a cluster for the new directory, near its parent
+	dirCluster = _FAT_fat_linkFreeClusterCleared (partition, CLUSTER_FREE, parentCluster);
 	if (!_FAT_fat_isValidCluster(partition, dirCluster)) {
 		// No space left on disc for the cluster
 		_FAT_unlock(&partition->lock);
@@ -455,7 +458,7 @@ int _FAT_mkdir_r (struct _reent *r, const char *path, int mode) {
 		_FAT_fat_clusterToSector (partition, dirCluster), DIR_ENTRY_DATA_SIZE, DIR_ENTRY_DATA_SIZE);
 
 	// Flush any sectors in the disc cache
-	if (!_FAT_cache_flush(partition->cache)) {
+	if (!_FAT_partition_flush(partition)) {
 		_FAT_unlock(&partition->lock);
 		r->_errno = EIO;
 		return -1;
@@ -472,7 +475,7 @@ int _FAT_rmdir_r (struct _reent *r, const char *path) {
 int _FAT_statvfs_r (struct _reent *r, const char *path, struct statvfs *buf)
 {
 	PARTITION* partition = NULL;
-	unsigned int freeClusterCount;
+	uint32_t freeClusterCount;
 
 	// Get the partition of the requested path
 	partition = _FAT_partition_getPartitionFromPath (path);
@@ -483,12 +486,13 @@ int _FAT_statvfs_r (struct _reent *r, const char *path, struct statvfs *buf)
 
 	_FAT_lock(&partition->lock);
 
-	if(partition->filesysType == FS_FAT32) {
-		// Sync FSinfo block
-		_FAT_partition_readFSinfo(partition);
-		freeClusterCount = partition->fat.numberFreeCluster;
-	} else {
-		freeClusterCount = _FAT_fat_freeClusterCount (partition);
+	// The free cluster count is kept up to date in memory, so there's no need to touch the disc
+	// unless it couldn't be counted before
+	freeClusterCount = _FAT_fat_freeClusters (partition);
+	if (freeClusterCount == CLUSTER_ERROR) {
+		_FAT_unlock(&partition->lock);
+		r->_errno = EIO;
+		return -1;
 	}
 
 	// FAT clusters = POSIX blocks
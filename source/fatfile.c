@@ -37,13 +37,18 @@
 #include <string.h>
 #include <errno.h>
 #include <ctype.h>
+#include <limits.h>
+#include <time.h>
 #include <unistd.h>
+#include <sys/iosupport.h>
 
 #include "cache.h"
 #include "file_allocation_table.h"
 #include "bit_ops.h"
 #include "filetime.h"
+#include "mem_allocate.h"
 #include "lock.h"
+#include "fatdir.h"
 
 bool _FAT_findEntry(const char *path, DIR_ENTRY *dirEntry) {
 	bool r;
@@ -118,7 +123,7 @@ int FAT_setAttr(const char *file, uint8_t attr) {
 	);
 
 	// Flush any sectors in the disc cache
-	if ( !_FAT_cache_flush( partition->cache ) ) {
+	if ( !_FAT_partition_flush( partition ) ) {
 		_FAT_unlock(&partition->lock); // Unlock Partition
 		return -1;
 	}
@@ -278,9 +283,11 @@ int _FAT_open_r (struct _reent *r, void *fileStruct, const char *path, int flags
 	file->startCluster = _FAT_directory_entryGetCluster (partition, dirEntry.entryData);
 
 	// Truncate the file if requested
+	file->preallocated = false;
 	if ((flags & O_TRUNC) && file->write && (file->startCluster != 0)) {
-		_FAT_fat_clearLinks (partition, file->startCluster);
-		file->startCluster = CLUSTER_FREE;
+		// Keep the clusters for the new contents to be written over, and
+		// give back whatever is left of them when the file is closed
+		file->preallocated = true;
 		file->filesize = 0;
 		// File is modified since we just cut it all off
 		file->modified = true;
@@ -299,8 +306,12 @@ int _FAT_open_r (struct _reent *r, void *fileStruct, const char *path, int flags
 	if (flags & O_APPEND) {
 		file->append = true;
 
-		// Set append pointer to the end of the file
-		file->appendPosition.cluster = _FAT_fat_lastCluster (partition, file->startCluster);
+		// Set append pointer to the end of the file, which is at the start of a kept chain
+		if (file->preallocated) {
+			file->appendPosition.cluster = file->startCluster;
+		} else {
+			file->appendPosition.cluster = _FAT_fat_lastCluster (partition, file->startCluster);
+		}
 		file->appendPosition.sector = (file->filesize % partition->bytesPerCluster) / partition->bytesPerSector;
 		file->appendPosition.byte = file->filesize % partition->bytesPerSector;
 
@@ -316,6 +327,22 @@ int _FAT_open_r (struct _reent *r, void *fileStruct, const char *path, int flags
 		file->appendPosition = file->rwPosition;
 	}
 
+	// Nothing has been remembered by fatPread or fatPwrite yet
+	file->hintPosition.cluster = CLUSTER_FREE;
+	file->hintOffset = 0;
+
+	// Nothing has been held back for delayed allocation yet
+	file->delayedData = NULL;
+	file->delayedLength = 0;
+	file->delayedSize = partition->delayedAllocSize;
+	file->delayedMaxAge = 0;
+	file->delayedSince = 0;
+
+	// Nothing has been read yet, so reading from the start counts as carrying on
+	file->readAheadNext = 0;
+	file->readAheadEnd = 0;
+	file->readAheadWindow = 0;
+
 	file->inUse = true;
 
 	// Insert this file into the double-linked list of open files
@@ -334,6 +361,9 @@ int _FAT_open_r (struct _reent *r, void *fileStruct, const char *path, int flags
 	return (int) file;
 }
 
+static bool _FAT_file_flushDelayed (struct _reent *r, FILE_STRUCT* file);
+static bool _FAT_file_positionAt (FILE_STRUCT* file, uint32_t offset, FILE_POSITION* position);
+
 /*
 Synchronizes the file data to disc.
 Does no locking of its own -- lock the partition before calling.
@@ -341,16 +371,29 @@ Returns 0 on success, an error code on failure.
 */
 int _FAT_syncToDisc (FILE_STRUCT* file) {
 	uint8_t dirEntryData[DIR_ENTRY_DATA_SIZE];
+	sec_t dirEntrySector;
+	int error = 0;
 
 	if (!file || !file->inUse) {
 		return EBADF;
 	}
 
+	// Data held back for delayed allocation gets its clusters now
+	if (!_FAT_file_flushDelayed (_REENT, file)) {
+		error = _REENT->_errno;
+	}
+
 	if (file->write && file->modified) {
+		// The file's data and the FAT have to be on the disc before the entry that leads to them.
+		// Data other files have written is left in the cache.
+		if (!_FAT_partition_flushOwner (file->partition, file)) {
+			return EIO;
+		}
+
 		// Load the old entry
+		dirEntrySector = _FAT_fat_clusterToSector(file->partition, file->dirEntryEnd.cluster) + file->dirEntryEnd.sector;
 		_FAT_cache_readPartialSector (file->partition->cache, dirEntryData,
-			_FAT_fat_clusterToSector(file->partition, file->dirEntryEnd.cluster) + file->dirEntryEnd.sector,
-			file->dirEntryEnd.offset * DIR_ENTRY_DATA_SIZE, DIR_ENTRY_DATA_SIZE);
+			dirEntrySector, file->dirEntryEnd.offset * DIR_ENTRY_DATA_SIZE, DIR_ENTRY_DATA_SIZE);
 
 		// Write new data to the directory entry
 		// File size
@@ -370,20 +413,23 @@ int _FAT_syncToDisc (FILE_STRUCT* file) {
 		// Set archive attribute
 		dirEntryData[DIR_ENTRY_attributes] |= ATTRIB_ARCH;
 
-		// Write the new entry
+		// Write the new entry, and then the sector holding it
 		_FAT_cache_writePartialSector (file->partition->cache, dirEntryData,
-			_FAT_fat_clusterToSector(file->partition, file->dirEntryEnd.cluster) + file->dirEntryEnd.sector,
-			file->dirEntryEnd.offset * DIR_ENTRY_DATA_SIZE, DIR_ENTRY_DATA_SIZE);
-
-		// Flush any sectors in the disc cache
-		if (!_FAT_cache_flush(file->partition->cache)) {
+			dirEntrySector, file->dirEntryEnd.offset * DIR_ENTRY_DATA_SIZE, DIR_ENTRY_DATA_SIZE);
+		if (!_FAT_cache_flushSectors (file->partition->cache, dirEntrySector, 1)) {
 			return EIO;
 		}
 	}
 
-	file->modified = false;
+	// Anything that couldn't be written out is still waiting
+	file->modified = (file->delayedLength > 0);
 
-	return 0;
+	// The entry no longer leads to any clusters the file freed, so they can be discarded
+	if (!file->modified && !_FAT_partition_discardFreed (file->partition) && (error == 0)) {
+		error = EIO;
+	}
+
+	return error;
 }
 
 
@@ -399,6 +445,9 @@ int _FAT_close_r (struct _reent *r, void *fd) {
 	_FAT_lock(&file->partition->lock);
 
 	if (file->write) {
+		// Preallocated clusters given back may be being read with the partition unlocked
+		_FAT_partition_waitForTransfers (file->partition);
+		_FAT_file_releasePreallocated (file);
 		ret = _FAT_syncToDisc (file);
 		if (ret != 0) {
 			r->_errno = ret;
@@ -406,6 +455,12 @@ int _FAT_close_r (struct _reent *r, void *fd) {
 		}
 	}
 
+	if (file->delayedData) {
+		_FAT_mem_free (file->delayedData);
+		file->delayedData = NULL;
+		file->delayedLength = 0;
+	}
+
 	file->inUse = false;
 
 	// Remove this file from the double-linked list of open files
@@ -424,45 +479,232 @@ int _FAT_close_r (struct _reent *r, void *fd) {
 	return ret;
 }
 
-ssize_t _FAT_read_r (struct _reent *r, void *fd, char *ptr, size_t len) {
-	FILE_STRUCT* file = (FILE_STRUCT*)  fd;
-	PARTITION* partition;
-	CACHE* cache;
+/*
+Find the runs of sectors that hold the bytes of the file from offset to end - 1,
+storing up to maxExtents of them in extents. offset must be less than end, and
+end no more than the file size.
+Returns the number of runs stored, or -1 if the cluster chain is broken.
+*/
+static int _FAT_file_mapRange (FILE_STRUCT* file, uint32_t offset, uint32_t end, FAT_EXTENT* extents, int maxExtents) {
+	PARTITION* partition = file->partition;
 	FILE_POSITION position;
-	uint32_t tempNextCluster;
-	unsigned int tempVar;
-	size_t remain;
-	bool flagNoError = true;
+	uint32_t cluster, nextCluster;
+	sec_t sector, count, remain;
+	int found = 0;
 
-	// Short circuit cases where len is 0 (or less)
-	if (len <= 0) {
-		return 0;
+	if (!_FAT_file_positionAt (file, offset, &position)) {
+		return -1;
 	}
 
-	// Make sure we can actually read from the file
-	if ((file == NULL) || !file->inUse || !file->read) {
-		r->_errno = EBADF;
-		return -1;
+	remain = ((end - 1) / partition->bytesPerSector) - (offset / partition->bytesPerSector) + 1;
+	cluster = position.cluster;
+	sector = _FAT_fat_clusterToSector (partition, cluster) + position.sector;
+	count = partition->sectorsPerCluster - position.sector;
+
+	while ((remain > 0) && (found < maxExtents)) {
+		// Take in the run of consecutive clusters that follows
+		if (count < remain) {
+			count += _FAT_fat_followChain (partition, &cluster, &nextCluster,
+				(remain - count + partition->sectorsPerCluster - 1) / partition->sectorsPerCluster, true)
+				* partition->sectorsPerCluster;
+		}
+		if (count > remain) {
+			count = remain;
+		}
+
+		extents[found].sector = sector;
+		extents[found].count = count;
+		found++;
+		remain -= count;
+
+		// The chain was followed up to the end of the range, so more sectors are in a new run
+		if (remain > 0) {
+			if (!_FAT_fat_isValidCluster (partition, nextCluster)) {
+				return -1;
+			}
+			cluster = nextCluster;
+			sector = _FAT_fat_clusterToSector (partition, cluster);
+			count = partition->sectorsPerCluster;
+		}
 	}
 
-	partition = file->partition;
+	return found;
+}
+
+/*
+The number of sectors a run of clusters must have to be read straight from the
+disc into the caller's buffer, bypassing the cache -- half the cache, which is
+as much as reading ahead would put in it.
+*/
+static sec_t _FAT_file_directSectors (PARTITION* partition) {
+	return (partition->cache->numberOfPages / 2) * partition->cache->sectorsPerPage;
+}
+
+/*
+Read sectors straight from the disc. If the disc can be used by several threads
+at once, the partition is unlocked while the disc is busy so that other threads
+can carry on with it. Dirty cached copies of the sectors are written back first
+so that the disc holds the latest data. Operations that free or move clusters
+wait for reads like this to finish before they start (see
+_FAT_partition_waitForTransfers), so the sectors can't be handed to another file
+before the read is done.
+Lock the partition before calling; it is locked again on return.
+*/
+static bool _FAT_file_readUnlocked (PARTITION* partition, sec_t sector, sec_t numSectors, void* buffer) {
+	bool ok;
+
+	if (!_FAT_cache_flushSectors (partition->cache, sector, numSectors)) {
+		return false;
+	}
+
+	// Keep the lock if the disc has to be used by one thread at a time, or if
+	// another thread is waiting for reads like this to finish, so that a file
+	// read straight through can't hold it up for ever. Without real condition
+	// variables, a thread waiting for the read would spin until it is done.
+	if (!_FAT_disc_isReentrant (partition->disc) || !_FAT_cond_available () ||
+		(partition->transferWaiters > 0))
+	{
+		return _FAT_disc_readSectors (partition->disc, sector, numSectors, buffer);
+	}
+
+	partition->transfers++;
+	_FAT_unlock(&partition->lock);
+	ok = _FAT_disc_readSectors (partition->disc, sector, numSectors, buffer);
 	_FAT_lock(&partition->lock);
+	partition->transfers--;
+
+	if ((partition->transfers == 0) && (partition->transferWaiters > 0)) {
+		_FAT_cond_broadcast(&partition->transfersDone);
+	}
+
+	return ok;
+}
+
+/*
+Keep track of whether the file is being read straight through, and if it is,
+load the clusters coming up into the cache ahead of time. The window of clusters
+read ahead doubles with each read that carries on from the last, up to half the
+cache, and is dropped when the file is read from anywhere else. Reads long enough
+to go straight to the disc aren't helped by it.
+*/
+static void _FAT_file_readAhead (FILE_STRUCT* file, uint32_t offset, size_t len) {
+	PARTITION* partition = file->partition;
+	CACHE* cache = partition->cache;
+	FAT_EXTENT extents[READ_AHEAD_EXTENTS];
+	uint32_t maxWindow, start, end, reached;
+	sec_t first, last, runStart, runEnd, budget;
+	int found, i;
+
+	if (offset != file->readAheadNext) {
+		file->readAheadWindow = 0;
+		file->readAheadEnd = offset;
+	} else {
+		maxWindow = _FAT_file_directSectors (partition) / partition->sectorsPerCluster;
+		if (file->readAheadWindow == 0) {
+			file->readAheadWindow = 1;
+		} else if (file->readAheadWindow < maxWindow) {
+			file->readAheadWindow *= 2;
+		}
+		if (file->readAheadWindow > maxWindow) {
+			file->readAheadWindow = maxWindow;
+		}
+	}
+	file->readAheadNext = offset + len;
+
+	if ((file->readAheadWindow == 0) || (len >= _FAT_file_directSectors (partition) * partition->bytesPerSector)) {
+		return;
+	}
+
+	// Wait until the read goes past what was read ahead last time. Reading ahead
+	// any sooner would push the pages still to be read out of the cache.
+	end = offset + len;
+	if (end <= file->readAheadEnd) {
+		return;
+	}
+
+	start = (file->readAheadEnd > offset) ? file->readAheadEnd : offset;
+	end = start + file->readAheadWindow * partition->bytesPerCluster;
+	if ((end > file->filesize) || (end < start)) {
+		end = file->filesize;
+	}
+	if (start >= end) {
+		return;
+	}
+
+	found = _FAT_file_mapRange (file, start, end, extents, READ_AHEAD_EXTENTS);
+	if (found <= 0) {
+		return;
+	}
+
+	// Read the runs a whole number of cache pages at a time. Runs with no more
+	// than a page between them are read together, gap and all, and no more than
+	// half the cache is read, so that the pages are still there when they are used.
+	budget = _FAT_file_directSectors (partition);
+	reached = start - (start % partition->bytesPerSector);
+	runStart = runEnd = 0;
+	for (i = 0; (i < found) && (budget > 0); i++) {
+		first = (extents[i].sector / cache->sectorsPerPage) * cache->sectorsPerPage;
+		last = ((extents[i].sector + extents[i].count + cache->sectorsPerPage - 1) / cache->sectorsPerPage) * cache->sectorsPerPage;
+		if ((runEnd == 0) || (first < runStart) || (first > runEnd + cache->sectorsPerPage)) {
+			if (runEnd > runStart) {
+				_FAT_cache_prefetch (cache, runStart, runEnd - runStart);
+			}
+			runStart = runEnd = first;
+		}
+		if (last > runEnd + budget) {
+			// Only the start of this run fits
+			last = runEnd + budget;
+			if (last > extents[i].sector) {
+				reached += (last - extents[i].sector) * partition->bytesPerSector;
+			}
+			runEnd = last;
+			break;
+		}
+		if (last > runEnd) {
+			budget -= last - runEnd;
+			runEnd = last;
+		}
+		reached += extents[i].count * partition->bytesPerSector;
+	}
+	if (runEnd > runStart) {
+		_FAT_cache_prefetch (cache, runStart, runEnd - runStart);
+	}
+
+	file->readAheadEnd = (reached < end) ? reached : end;
+}
+
+/*
+Read up to len bytes from offset in the file, starting at *where, which must be
+the position of offset in the cluster chain. *where is moved on past the bytes read.
+Long runs of clusters are read with the partition unlocked, so the file's own read
+position isn't used while the read is going on.
+Lock the partition before calling. It may be released while the disc is read.
+*/
+static ssize_t _FAT_file_readAt (struct _reent *r, FILE_STRUCT* file, FILE_POSITION* where, uint32_t offset, char *ptr, size_t len) {
+	PARTITION* partition = file->partition;
+	CACHE* cache;
+	FILE_POSITION position;
+	uint32_t tempNextCluster;
+	unsigned int tempVar;
+	size_t remain;
+	bool flagNoError = true;
 
 	// Don't try to read if the read pointer is past the end of file
-	if (file->currentPosition >= file->filesize || file->startCluster == CLUSTER_FREE) {
+	if (offset >= file->filesize || file->startCluster == CLUSTER_FREE) {
 		r->_errno = EOVERFLOW;
-		_FAT_unlock(&partition->lock);
 		return 0;
 	}
 
 	// Don't read past end of file
-	if (len + file->currentPosition > file->filesize) {
+	if (len + offset > file->filesize) {
 		r->_errno = EOVERFLOW;
-		len = file->filesize - file->currentPosition;
+		len = file->filesize - offset;
 	}
 
+	_FAT_file_readAhead (file, offset, len);
+
 	remain = len;
-	position = file->rwPosition;
+	position = *where;
 	cache = file->partition->cache;
 
 	// Align to sector
@@ -524,23 +766,32 @@ ssize_t _FAT_read_r (struct _reent *r, void *fd, char *ptr, size_t len) {
 
 	// Read in whole clusters, contiguous blocks at a time
 	while ((remain >= partition->bytesPerCluster) && flagNoError) {
-		uint32_t chunkEnd;
-		uint32_t nextChunkStart = position.cluster;
-		size_t chunkSize = 0;
+		uint32_t chunkEnd = position.cluster;
+		uint32_t nextChunkStart;
+		uint32_t chunkClusters = remain / partition->bytesPerCluster;
+		size_t chunkSize;
 
-		do {
-			chunkEnd = nextChunkStart;
-			nextChunkStart = _FAT_fat_nextCluster (partition, chunkEnd);
-			chunkSize += partition->bytesPerCluster;
-		} while ((nextChunkStart == chunkEnd + 1) &&
 #ifdef LIMIT_SECTORS
-		 	(chunkSize + partition->bytesPerCluster <= LIMIT_SECTORS * partition->bytesPerSector) &&
+		if (chunkClusters > LIMIT_SECTORS / partition->sectorsPerCluster) {
+			chunkClusters = LIMIT_SECTORS / partition->sectorsPerCluster;
+		}
+		if (chunkClusters == 0) {
+			chunkClusters = 1;
+		}
 #endif
-			(chunkSize + partition->bytesPerCluster <= remain));
-
-		if (!_FAT_cache_readSectors (cache, _FAT_fat_clusterToSector (partition, position.cluster),
-				chunkSize / partition->bytesPerSector, ptr))
-		{
+		// Group consecutive clusters, decoding their links a whole FAT sector at a time
+		chunkClusters = _FAT_fat_followChain (partition, &chunkEnd, &nextChunkStart, chunkClusters - 1, true) + 1;
+		chunkSize = chunkClusters * partition->bytesPerCluster;
+
+		// Runs too long to be worth caching go straight to the disc, without holding up other threads
+		if (chunkSize / partition->bytesPerSector >= _FAT_file_directSectors (partition)) {
+			flagNoError = _FAT_file_readUnlocked (partition, _FAT_fat_clusterToSector (partition, position.cluster),
+				chunkSize / partition->bytesPerSector, ptr);
+		} else {
+			flagNoError = _FAT_cache_readSectors (cache, _FAT_fat_clusterToSector (partition, position.cluster),
+				chunkSize / partition->bytesPerSector, ptr);
+		}
+		if (!flagNoError) {
 			flagNoError = false;
 			r->_errno = EIO;
 			break;
@@ -588,12 +839,58 @@ ssize_t _FAT_read_r (struct _reent *r, void *fd, char *ptr, size_t len) {
 	// Length read is the wanted length minus the stuff not read
 	len = len - remain;
 
+	*where = position;
+
+	return len;
+}
+
+/*
+Read up to len bytes from the file's read position.
+Lock the partition before calling. It may be released while the disc is read.
+*/
+static ssize_t _FAT_file_read (struct _reent *r, FILE_STRUCT* file, char *ptr, size_t len) {
+	FILE_POSITION position;
+	ssize_t ret;
+
+	// Data held back for delayed allocation has to be written before anything else is done with the file
+	if (!_FAT_file_flushDelayed (r, file)) {
+		return -1;
+	}
+
+	position = file->rwPosition;
+	ret = _FAT_file_readAt (r, file, &position, file->currentPosition, ptr, len);
+
 	// Update file information
-	file->rwPosition = position;
-	file->currentPosition += len;
+	if (ret > 0) {
+		file->rwPosition = position;
+		file->currentPosition += ret;
+	}
+
+	return ret;
+}
+
+ssize_t _FAT_read_r (struct _reent *r, void *fd, char *ptr, size_t len) {
+	FILE_STRUCT* file = (FILE_STRUCT*)  fd;
+	PARTITION* partition;
+	ssize_t ret;
 
+	// Short circuit cases where len is 0 (or less)
+	if (len <= 0) {
+		return 0;
+	}
+
+	// Make sure we can actually read from the file
+	if ((file == NULL) || !file->inUse || !file->read) {
+		r->_errno = EBADF;
+		return -1;
+	}
+
+	partition = file->partition;
+	_FAT_lock(&partition->lock);
+	ret = _FAT_file_read (r, file, ptr, len);
 	_FAT_unlock(&partition->lock);
-	return len;
+
+	return ret;
 }
 
 // if current position is on the cluster border and more data has to be written
@@ -633,6 +930,46 @@ err:
 	return false;
 }
 
+/*
+Write the file's own data through the cache, with the pages it dirties
+belonging to the file. Everything else, such as allocating clusters, is
+left unowned so that any file's fsync writes it.
+*/
+static bool _FAT_file_writeData (FILE_STRUCT* file, sec_t sector, sec_t numSectors, const void* buffer) {
+	CACHE* cache = file->partition->cache;
+	const void* previousOwner = _FAT_cache_setOwner (cache, file);
+	bool ok = _FAT_cache_writeSectors (cache, sector, numSectors, buffer);
+
+	_FAT_cache_setOwner (cache, previousOwner);
+	return ok;
+}
+
+static bool _FAT_file_writePartialData (FILE_STRUCT* file, const void* buffer, sec_t sector, unsigned int offset,
+	size_t size, bool erase)
+{
+	CACHE* cache = file->partition->cache;
+	const void* previousOwner = _FAT_cache_setOwner (cache, file);
+	bool ok;
+
+	if (erase) {
+		ok = _FAT_cache_eraseWritePartialSector (cache, buffer, sector, offset, size);
+	} else {
+		ok = _FAT_cache_writePartialSector (cache, buffer, sector, offset, size);
+	}
+
+	_FAT_cache_setOwner (cache, previousOwner);
+	return ok;
+}
+
+static bool _FAT_file_zeroData (FILE_STRUCT* file, sec_t sector, sec_t numSectors) {
+	CACHE* cache = file->partition->cache;
+	const void* previousOwner = _FAT_cache_setOwner (cache, file);
+	bool ok = _FAT_cache_zeroSectors (cache, sector, numSectors);
+
+	_FAT_cache_setOwner (cache, previousOwner);
+	return ok;
+}
+
 /*
 Extend a file so that the size is the same as the rwPosition
 */
@@ -640,17 +977,27 @@ static bool _FAT_file_extend_r (struct _reent *r, FILE_STRUCT* file) {
 	PARTITION* partition = file->partition;
 	CACHE* cache = file->partition->cache;
 	FILE_POSITION position;
-	uint8_t zeroBuffer [partition->bytesPerSector];
-	memset(zeroBuffer, 0, partition->bytesPerSector);
 	uint32_t remain;
 	uint32_t tempNextCluster;
-	unsigned int sector;
+	sec_t sector;
+	sec_t runStart = 0;
+	sec_t runLength = 0;
+	uint32_t sectors;
 
 	position.byte = file->filesize % partition->bytesPerSector;
 	position.sector = (file->filesize % partition->bytesPerCluster) / partition->bytesPerSector;
 	// It is assumed that there is always a startCluster
 	// This will be true when _FAT_file_extend_r is called from _FAT_write_r
-	position.cluster = _FAT_fat_lastCluster (partition, file->startCluster);
+	if (!file->preallocated) {
+		position.cluster = _FAT_fat_lastCluster (partition, file->startCluster);
+	} else {
+		// The chain goes on past the end of the file, so find the cluster the end is in
+		position.cluster = file->startCluster;
+		if (file->filesize > 0) {
+			_FAT_fat_followChain (partition, &position.cluster, &tempNextCluster,
+				(file->filesize - 1) / partition->bytesPerCluster, false);
+		}
+	}
 
 	remain = file->currentPosition - file->filesize;
 
@@ -668,19 +1015,20 @@ static bool _FAT_file_extend_r (struct _reent *r, FILE_STRUCT* file) {
 
 	if (remain + position.byte < partition->bytesPerSector) {
 		// Only need to clear to the end of the sector
-		_FAT_cache_writePartialSector (cache, zeroBuffer,
-			_FAT_fat_clusterToSector (partition, position.cluster) + position.sector, position.byte, remain);
+		_FAT_file_writePartialData (file, cache->zeroBuffer,
+			_FAT_fat_clusterToSector (partition, position.cluster) + position.sector, position.byte, remain, false);
 		position.byte += remain;
 	} else {
 		if (position.byte > 0) {
-			_FAT_cache_writePartialSector (cache, zeroBuffer,
+			_FAT_file_writePartialData (file, cache->zeroBuffer,
 				_FAT_fat_clusterToSector (partition, position.cluster) + position.sector, position.byte,
-				partition->bytesPerSector - position.byte);
+				partition->bytesPerSector - position.byte, false);
 			remain -= (partition->bytesPerSector - position.byte);
 			position.byte = 0;
 			position.sector ++;
 		}
 
+		// Whole sectors are zeroed a run of consecutive clusters at a time
 		while (remain >= partition->bytesPerSector) {
 			if (position.sector >= partition->sectorsPerCluster) {
 				position.sector = 0;
@@ -694,11 +1042,31 @@ static bool _FAT_file_extend_r (struct _reent *r, FILE_STRUCT* file) {
 				position.cluster = tempNextCluster;
 			}
 
+			sectors = partition->sectorsPerCluster - position.sector;
+			if (sectors > remain / partition->bytesPerSector) {
+				sectors = remain / partition->bytesPerSector;
+			}
+
 			sector = _FAT_fat_clusterToSector (partition, position.cluster) + position.sector;
-			_FAT_cache_writeSectors (cache, sector, 1, zeroBuffer);
+			if ((runLength > 0) && (runStart + runLength != sector)) {
+				if (!_FAT_file_zeroData (file, runStart, runLength)) {
+					r->_errno = EIO;
+					return false;
+				}
+				runLength = 0;
+			}
+			if (runLength == 0) {
+				runStart = sector;
+			}
+			runLength += sectors;
 
-			remain -= partition->bytesPerSector;
-			position.sector ++;
+			remain -= sectors * partition->bytesPerSector;
+			position.sector += sectors;
+		}
+
+		if ((runLength > 0) && !_FAT_file_zeroData (file, runStart, runLength)) {
+			r->_errno = EIO;
+			return false;
 		}
 
 		if (!_FAT_check_position_for_next_cluster(r, &position, partition, remain, NULL)) {
@@ -707,8 +1075,8 @@ static bool _FAT_file_extend_r (struct _reent *r, FILE_STRUCT* file) {
 		}
 
 		if (remain > 0) {
-			_FAT_cache_writePartialSector (cache, zeroBuffer,
-				_FAT_fat_clusterToSector (partition, position.cluster) + position.sector, 0, remain);
+			_FAT_file_writePartialData (file, cache->zeroBuffer,
+				_FAT_fat_clusterToSector (partition, position.cluster) + position.sector, 0, remain, false);
 			position.byte = remain;
 		}
 	}
@@ -718,10 +1086,12 @@ static bool _FAT_file_extend_r (struct _reent *r, FILE_STRUCT* file) {
 	return true;
 }
 
-ssize_t _FAT_write_r (struct _reent *r, void *fd, const char *ptr, size_t len) {
-	FILE_STRUCT* file = (FILE_STRUCT*)  fd;
-	PARTITION* partition;
-	CACHE* cache;
+/*
+Write len bytes at the file's write position, allocating clusters as they are needed.
+Does no locking of its own -- lock the partition before calling.
+*/
+static ssize_t _FAT_file_write (struct _reent *r, FILE_STRUCT* file, const char *ptr, size_t len) {
+	PARTITION* partition = file->partition;
 	FILE_POSITION position;
 	uint32_t tempNextCluster;
 	unsigned int tempVar;
@@ -729,16 +1099,6 @@ ssize_t _FAT_write_r (struct _reent *r, void *fd, const char *ptr, size_t len) {
 	bool flagNoError = true;
 	bool flagAppending = false;
 
-	// Make sure we can actually write to the file
-	if ((file == NULL) || !file->inUse || !file->write) {
-		r->_errno = EBADF;
-		return -1;
-	}
-
-	partition = file->partition;
-	cache = file->partition->cache;
-	_FAT_lock(&partition->lock);
-
 	// Only write up to the maximum file size, taking into account wrap-around of ints
 	if (len + file->filesize > FILE_MAX_SIZE || len + file->filesize < file->filesize) {
 		len = FILE_MAX_SIZE - file->filesize;
@@ -746,7 +1106,6 @@ ssize_t _FAT_write_r (struct _reent *r, void *fd, const char *ptr, size_t len) {
 
 	// Short circuit cases where len is 0 (or less)
 	if (len <= 0) {
-		_FAT_unlock(&partition->lock);
 		return 0;
 	}
 
@@ -754,10 +1113,10 @@ ssize_t _FAT_write_r (struct _reent *r, void *fd, const char *ptr, size_t len) {
 
 	// Get a new cluster for the start of the file if required
 	if (file->startCluster == CLUSTER_FREE) {
-		tempNextCluster = _FAT_fat_linkFreeCluster (partition, CLUSTER_FREE);
+		// Place it near the directory that holds the file
+		tempNextCluster = _FAT_fat_linkFreeClusterNear (partition, CLUSTER_FREE, file->dirEntryEnd.cluster);
 		if (!_FAT_fat_isValidCluster(partition, tempNextCluster)) {
 			// Couldn't get a cluster, so abort immediately
-			_FAT_unlock(&partition->lock);
 			r->_errno = ENOSPC;
 			return -1;
 		}
@@ -780,7 +1139,6 @@ ssize_t _FAT_write_r (struct _reent *r, void *fd, const char *ptr, size_t len) {
 		// If the write pointer is past the end of the file, extend the file to that size
 		if (file->currentPosition > file->filesize) {
 			if (!_FAT_file_extend_r (r, file)) {
-				_FAT_unlock(&partition->lock);
 				return -1;
 			}
 		}
@@ -805,8 +1163,8 @@ ssize_t _FAT_write_r (struct _reent *r, void *fd, const char *ptr, size_t len) {
 
 	if ((tempVar < partition->bytesPerSector) && flagNoError) {
 		// Write partial sector to disk
-		_FAT_cache_writePartialSector (cache, ptr,
-			_FAT_fat_clusterToSector (partition, position.cluster) + position.sector, position.byte, tempVar);
+		_FAT_file_writePartialData (file, ptr,
+			_FAT_fat_clusterToSector (partition, position.cluster) + position.sector, position.byte, tempVar, false);
 
 		remain -= tempVar;
 		ptr += tempVar;
@@ -829,7 +1187,7 @@ ssize_t _FAT_write_r (struct _reent *r, void *fd, const char *ptr, size_t len) {
 	}
 
 	if ((tempVar > 0 && tempVar < partition->sectorsPerCluster) && flagNoError) {
-		if (!_FAT_cache_writeSectors (cache,
+		if (!_FAT_file_writeData (file,
 			_FAT_fat_clusterToSector (partition, position.cluster) + position.sector, tempVar, ptr))
 		{
 			flagNoError = false;
@@ -871,7 +1229,7 @@ ssize_t _FAT_write_r (struct _reent *r, void *fd, const char *ptr, size_t len) {
 			chunkSize += partition->bytesPerCluster;
 		}
 
-		if ( !_FAT_cache_writeSectors (cache,
+		if ( !_FAT_file_writeData (file,
 				_FAT_fat_clusterToSector(partition, position.cluster), chunkSize / partition->bytesPerSector, ptr))
 		{
 			flagNoError = false;
@@ -898,7 +1256,7 @@ ssize_t _FAT_write_r (struct _reent *r, void *fd, const char *ptr, size_t len) {
 	// Write remaining sectors
 	tempVar = remain / partition->bytesPerSector; // Number of sectors left
 	if ((tempVar > 0) && flagNoError) {
-		if (!_FAT_cache_writeSectors (cache, _FAT_fat_clusterToSector (partition, position.cluster), tempVar, ptr))
+		if (!_FAT_file_writeData (file, _FAT_fat_clusterToSector (partition, position.cluster), tempVar, ptr))
 		{
 			flagNoError = false;
 			r->_errno = EIO;
@@ -911,13 +1269,8 @@ ssize_t _FAT_write_r (struct _reent *r, void *fd, const char *ptr, size_t len) {
 
 	// Last remaining sector
 	if ((remain > 0) && flagNoError) {
-		if (flagAppending) {
-			_FAT_cache_eraseWritePartialSector ( cache, ptr,
-				_FAT_fat_clusterToSector (partition, position.cluster) + position.sector, 0, remain);
-		} else {
-			_FAT_cache_writePartialSector ( cache, ptr,
-				_FAT_fat_clusterToSector (partition, position.cluster) + position.sector, 0, remain);
-		}
+		_FAT_file_writePartialData (file, ptr,
+			_FAT_fat_clusterToSector (partition, position.cluster) + position.sector, 0, remain, flagAppending);
 		position.byte += remain;
 		remain = 0;
 	}
@@ -940,49 +1293,311 @@ ssize_t _FAT_write_r (struct _reent *r, void *fd, const char *ptr, size_t len) {
 			file->filesize = file->currentPosition;
 		}
 	}
-	_FAT_unlock(&partition->lock);
 
 	return len;
 }
 
+/*
+Make sure the file has the clusters to hold size bytes, allocating the missing ones
+in as few runs as possible. If there isn't room, nothing is allocated and the
+clusters are left to be found one at a time as the data is written.
+*/
+static bool _FAT_file_allocateTo (FILE_STRUCT* file, uint32_t size) {
+	PARTITION* partition = file->partition;
+	uint32_t needed, have, oldLength;
+	uint32_t lastCluster, firstCluster;
+	uint32_t run;
 
-off_t _FAT_seek_r (struct _reent *r, void *fd, off_t pos, int dir) {
-	FILE_STRUCT* file = (FILE_STRUCT*)  fd;
-	PARTITION* partition;
-	uint32_t cluster, nextCluster;
-	int clusCount;
-	off_t newPosition;
-	uint32_t position;
-
-	if ((file == NULL) || (file->inUse == false))	 {
-		// invalid file
-		r->_errno = EBADF;
-		return -1;
+	if (size == 0) {
+		return true;
 	}
 
-	partition = file->partition;
-	_FAT_lock(&partition->lock);
+	needed = ((size - 1) / partition->bytesPerCluster) + 1;
+	lastCluster = _FAT_fat_chainTail (partition, file->startCluster, &have);
+	oldLength = have;
+	run = needed - have;
 
-	switch (dir) {
-		case SEEK_SET:
-			newPosition = pos;
-			break;
-		case SEEK_CUR:
-			newPosition = (off_t)file->currentPosition + pos;
-			break;
-		case SEEK_END:
-			newPosition = (off_t)file->filesize + pos;
-			break;
-		default:
-			_FAT_unlock(&partition->lock);
-			r->_errno = EINVAL;
-			return -1;
-	}
+	while (have < needed) {
+		if (run > needed - have) {
+			run = needed - have;
+		}
+		firstCluster = _FAT_fat_linkFreeRun (partition, lastCluster, run, file->dirEntryEnd.cluster);
+		if (firstCluster == CLUSTER_ERROR) {
+			if (run > 1) {
+				// No free run that long, so make do with shorter ones
+				run = (run + 1) / 2;
+				continue;
+			}
+			// Out of space, so give back what was taken
+			if (oldLength > 0) {
+				_FAT_fat_trimChain (partition, file->startCluster, oldLength);
+			} else if (file->startCluster != CLUSTER_FREE) {
+				_FAT_fat_clearLinks (partition, file->startCluster);
+				file->startCluster = CLUSTER_FREE;
+				file->rwPosition.cluster = CLUSTER_FREE;
+				file->appendPosition.cluster = CLUSTER_FREE;
+				file->hintPosition.cluster = CLUSTER_FREE;
+			}
+			return false;
+		}
 
-	if ((pos > 0) && (newPosition < 0)) {
-		_FAT_unlock(&partition->lock);
-		r->_errno = EOVERFLOW;
-		return -1;
+		if (file->startCluster == CLUSTER_FREE) {
+			file->startCluster = firstCluster;
+
+			file->appendPosition.cluster = firstCluster;
+			file->appendPosition.sector = 0;
+			file->appendPosition.byte = 0;
+			file->rwPosition = file->appendPosition;
+		}
+
+		lastCluster = firstCluster + run - 1;
+		have += run;
+	}
+
+	// The chain goes on past the end of the file until the data is written, and
+	// if the write comes up short, what it didn't use is given back on close
+	if (size > file->filesize) {
+		file->preallocated = true;
+	}
+
+	return true;
+}
+
+/*
+Write out the data held back for delayed allocation, after giving it all of its
+clusters together. Anything that can't be written stays held back.
+Returns false, with r->_errno set, if it couldn't all be written.
+*/
+static bool _FAT_file_flushDelayed (struct _reent *r, FILE_STRUCT* file) {
+	uint32_t length = file->delayedLength;
+	ssize_t written;
+
+	if (length == 0) {
+		return true;
+	}
+
+	_FAT_file_allocateTo (file, file->filesize + length);
+
+	file->delayedLength = 0;
+	written = _FAT_file_write (r, file, (const char*)file->delayedData, length);
+	if (written < 0) {
+		written = 0;
+	}
+	if ((uint32_t)written < length) {
+		memmove (file->delayedData, file->delayedData + written, length - written);
+		file->delayedLength = length - written;
+		return false;
+	}
+
+	return true;
+}
+
+/*
+Returns true if the file has data held back for longer than it is allowed to be
+*/
+static bool _FAT_file_delayedExpired (FILE_STRUCT* file, time_t now) {
+	return (file->delayedLength > 0) && (file->delayedMaxAge > 0) &&
+		(now != (time_t)-1) && (now - file->delayedSince >= (time_t)file->delayedMaxAge);
+}
+
+/*
+Write to the end of a file with delayed allocation. Small writes are held in
+memory, with no clusters given to them until they are flushed. If the data
+doesn't fit, or there isn't the memory to hold it, it is all given clusters
+in one go and written out straight away.
+*/
+static ssize_t _FAT_file_writeDelayed (struct _reent *r, FILE_STRUCT* file, const char *ptr, size_t len) {
+	uint32_t pendingEnd = file->filesize + file->delayedLength;
+
+	// Only write up to the maximum file size
+	if (len > FILE_MAX_SIZE - pendingEnd) {
+		len = FILE_MAX_SIZE - pendingEnd;
+	}
+
+	if (len == 0) {
+		return 0;
+	}
+
+	if ((file->delayedData == NULL) && (len < file->delayedSize)) {
+		file->delayedData = (uint8_t*) _FAT_mem_allocate (file->delayedSize);
+	}
+
+	if ((file->delayedData != NULL) && (len <= file->delayedSize - file->delayedLength)) {
+		if (file->delayedLength == 0) {
+			file->delayedSince = time (NULL);
+		}
+		memcpy (file->delayedData + file->delayedLength, ptr, len);
+		file->delayedLength += len;
+		file->modified = true;
+
+		// Data that has been held back for too long goes to the disc now. If
+		// that fails, it stays held back, and this write has still been done.
+		if (_FAT_file_delayedExpired (file, time (NULL))) {
+			_FAT_syncToDisc (file);
+		}
+		return len;
+	}
+
+	_FAT_file_allocateTo (file, pendingEnd + len);
+
+	if (!_FAT_file_flushDelayed (r, file)) {
+		return -1;
+	}
+
+	return _FAT_file_write (r, file, ptr, len);
+}
+
+/*
+Write len bytes at the file's write position, holding them back if delayed
+allocation applies.
+Does no locking of its own -- lock the partition before calling.
+*/
+static ssize_t _FAT_file_writeAtPosition (struct _reent *r, FILE_STRUCT* file, const char *ptr, size_t len) {
+	// Delayed allocation only holds back data written to the end of the file
+	if ((file->delayedSize > 0) &&
+		((file->delayedLength > 0) || file->append || (file->currentPosition == file->filesize)))
+	{
+		return _FAT_file_writeDelayed (r, file, ptr, len);
+	}
+
+	return _FAT_file_write (r, file, ptr, len);
+}
+
+ssize_t _FAT_write_r (struct _reent *r, void *fd, const char *ptr, size_t len) {
+	FILE_STRUCT* file = (FILE_STRUCT*)  fd;
+	PARTITION* partition;
+	ssize_t written;
+
+	// Make sure we can actually write to the file
+	if ((file == NULL) || !file->inUse || !file->write) {
+		r->_errno = EBADF;
+		return -1;
+	}
+
+	partition = file->partition;
+	_FAT_lock(&partition->lock);
+	written = _FAT_file_writeAtPosition (r, file, ptr, len);
+	_FAT_unlock(&partition->lock);
+
+	return written;
+}
+
+
+/*
+Work out where offset is in the file's cluster chain. The chain is followed from
+whichever is closest before offset of the start of the file, the read/write
+position and the position fatPread or fatPwrite last finished at.
+offset must be no more than the file size, and the file must have a startCluster.
+Returns false if the chain is too short.
+*/
+static bool _FAT_file_positionAt (FILE_STRUCT* file, uint32_t offset, FILE_POSITION* position) {
+	PARTITION* partition = file->partition;
+	FILE_POSITION from;
+	uint32_t fromOffset;
+	uint32_t cluster, nextCluster;
+	uint32_t clusCount;
+	uint32_t knownCount;
+
+	// how many clusters from start of file
+	clusCount = offset / partition->bytesPerCluster;
+
+	from.cluster = file->startCluster;
+	from.sector = 0;
+	fromOffset = 0;
+
+	if ((offset == file->filesize) && (clusCount > 0)) {
+		// Seeking to the end of the file, so start from the end of the cluster chain
+		uint32_t chainLength;
+		uint32_t lastCluster = _FAT_fat_chainTail (partition, file->startCluster, &chainLength);
+		if ((chainLength > 0) && (clusCount >= chainLength - 1)) {
+			from.cluster = lastCluster;
+			fromOffset = (chainLength - 1) * partition->bytesPerCluster;
+		}
+	} else {
+		if ((offset >= file->currentPosition) && (file->rwPosition.cluster != CLUSTER_FREE)) {
+			from = file->rwPosition;
+			fromOffset = file->currentPosition;
+		}
+		if ((file->hintPosition.cluster != CLUSTER_FREE) &&
+			(file->hintOffset <= offset) && (file->hintOffset > fromOffset))
+		{
+			from = file->hintPosition;
+			fromOffset = file->hintOffset;
+		}
+	}
+
+	// A position at the end of a cluster is still in that cluster
+	knownCount = fromOffset / partition->bytesPerCluster;
+	if ((from.sector == partition->sectorsPerCluster) && (knownCount > 0)) {
+		knownCount--;
+	}
+	clusCount -= knownCount;
+	cluster = from.cluster;
+
+	// Calculate the sector and byte of the position
+	position->sector = (offset % partition->bytesPerCluster) / partition->bytesPerSector;
+	position->byte = offset % partition->bytesPerSector;
+
+	if (clusCount > 0) {
+		clusCount -= _FAT_fat_followChain (partition, &cluster, &nextCluster, clusCount, false);
+	}
+
+	// Check if ran out of clusters and it needs to allocate a new one
+	if (clusCount > 0) {
+		if ((clusCount == 1) && (file->filesize == offset) && (position->sector == 0)) {
+			// Set flag to allocate a new cluster
+			position->sector = partition->sectorsPerCluster;
+			position->byte = 0;
+		} else {
+			return false;
+		}
+	}
+
+	position->cluster = cluster;
+	return true;
+}
+
+off_t _FAT_seek_r (struct _reent *r, void *fd, off_t pos, int dir) {
+	FILE_STRUCT* file = (FILE_STRUCT*)  fd;
+	PARTITION* partition;
+	off_t newPosition;
+	uint32_t position;
+
+	if ((file == NULL) || (file->inUse == false))	 {
+		// invalid file
+		r->_errno = EBADF;
+		return -1;
+	}
+
+	partition = file->partition;
+	_FAT_lock(&partition->lock);
+
+	// Make the file size and position include any data held back
+	if (!_FAT_file_flushDelayed (r, file)) {
+		_FAT_unlock(&partition->lock);
+		return -1;
+	}
+
+	switch (dir) {
+		case SEEK_SET:
+			newPosition = pos;
+			break;
+		case SEEK_CUR:
+			newPosition = (off_t)file->currentPosition + pos;
+			break;
+		case SEEK_END:
+			newPosition = (off_t)file->filesize + pos;
+			break;
+		default:
+			_FAT_unlock(&partition->lock);
+			r->_errno = EINVAL;
+			return -1;
+	}
+
+	if ((pos > 0) && (newPosition < 0)) {
+		_FAT_unlock(&partition->lock);
+		r->_errno = EOVERFLOW;
+		return -1;
 	}
 
 	// newPosition can only be larger than the FILE_MAX_SIZE on platforms where
@@ -998,45 +1613,11 @@ off_t _FAT_seek_r (struct _reent *r, void *fd, off_t pos, int dir) {
 	// Only change the read/write position if it is within the bounds of the current filesize,
 	// or at the very edge of the file
 	if (position <= file->filesize && file->startCluster != CLUSTER_FREE) {
-		// Calculate where the correct cluster is
-		// how many clusters from start of file
-		clusCount = position / partition->bytesPerCluster;
-		cluster = file->startCluster;
-		if (position >= file->currentPosition) {
-			// start from current cluster
-			int currentCount = file->currentPosition / partition->bytesPerCluster;
-			if (file->rwPosition.sector == partition->sectorsPerCluster) {
-				currentCount--;
-			}
-			clusCount -= currentCount;
-			cluster = file->rwPosition.cluster;
-		}
-		// Calculate the sector and byte of the current position,
-		// and store them
-		file->rwPosition.sector = (position % partition->bytesPerCluster) / partition->bytesPerSector;
-		file->rwPosition.byte = position % partition->bytesPerSector;
-
-		nextCluster = _FAT_fat_nextCluster (partition, cluster);
-		while ((clusCount > 0) && (nextCluster != CLUSTER_FREE) && (nextCluster != CLUSTER_EOF)) {
-			clusCount--;
-			cluster = nextCluster;
-			nextCluster = _FAT_fat_nextCluster (partition, cluster);
-		}
-
-		// Check if ran out of clusters and it needs to allocate a new one
-		if (clusCount > 0) {
-			if ((clusCount == 1) && (file->filesize == position) && (file->rwPosition.sector == 0)) {
-				// Set flag to allocate a new cluster
-				file->rwPosition.sector = partition->sectorsPerCluster;
-				file->rwPosition.byte = 0;
-			} else {
-				_FAT_unlock(&partition->lock);
-				r->_errno = EINVAL;
-				return -1;
-			}
+		if (!_FAT_file_positionAt (file, position, &file->rwPosition)) {
+			_FAT_unlock(&partition->lock);
+			r->_errno = EINVAL;
+			return -1;
 		}
-
-		file->rwPosition.cluster = cluster;
 	}
 
 	// Save position
@@ -1062,6 +1643,12 @@ int _FAT_fstat_r (struct _reent *r, void *fd, struct stat *st) {
 	partition = file->partition;
 	_FAT_lock(&partition->lock);
 
+	// Make the file size include any data held back
+	if (!_FAT_file_flushDelayed (r, file)) {
+		_FAT_unlock(&partition->lock);
+		return -1;
+	}
+
 	// Get the file's entry data
 	fileEntry.dataStart = file->dirEntryStart;
 	fileEntry.dataEnd = file->dirEntryEnd;
@@ -1116,13 +1703,22 @@ int _FAT_ftruncate_r (struct _reent *r, void *fd, off_t len) {
 	partition = file->partition;
 	_FAT_lock(&partition->lock);
 
+	// Clusters cut off the end may be being read with the partition unlocked
+	_FAT_partition_waitForTransfers (partition);
+
+	// The file size has to include any data held back before it is changed
+	if (!_FAT_file_flushDelayed (r, file)) {
+		_FAT_unlock(&partition->lock);
+		return -1;
+	}
+
 	if (newSize > file->filesize) {
 		// Expanding the file
 		FILE_POSITION savedPosition;
 		uint32_t savedOffset;
 		// Get a new cluster for the start of the file if required
 		if (file->startCluster == CLUSTER_FREE) {
-			uint32_t tempNextCluster = _FAT_fat_linkFreeCluster (partition, CLUSTER_FREE);
+			uint32_t tempNextCluster = _FAT_fat_linkFreeClusterNear (partition, CLUSTER_FREE, file->dirEntryEnd.cluster);
 			if (!_FAT_fat_isValidCluster(partition, tempNextCluster)) {
 				// Couldn't get a cluster, so abort immediately
 				_FAT_unlock(&partition->lock);
@@ -1184,6 +1780,11 @@ int _FAT_ftruncate_r (struct _reent *r, void *fd, off_t len) {
 				file->appendPosition.cluster = lastCluster;
 			}
 		}
+
+		// The position remembered by fatPread or fatPwrite may be in the part cut off.
+		// This comes after the clusters are freed, which waits for reads in progress
+		// that could remember a position of their own.
+		file->hintPosition.cluster = CLUSTER_FREE;
 	} else {
 		// Truncating to same length, so don't do anything
 	}
@@ -1216,3 +1817,746 @@ int _FAT_fsync_r (struct _reent *r, void *fd) {
 
 	return ret;
 }
+
+FILE_STRUCT* _FAT_file_fromFd (int fd) {
+	__handle* handle = __get_handle (fd);
+
+	if ((handle == NULL) || (devoptab_list[handle->device]->open_r != _FAT_open_r)) {
+		return NULL;
+	}
+
+	return (FILE_STRUCT*) handle->fileStruct;
+}
+
+void _FAT_file_releasePreallocated (FILE_STRUCT* file) {
+	PARTITION* partition = file->partition;
+	uint32_t size;
+
+	if (!file->preallocated) {
+		return;
+	}
+	file->preallocated = false;
+
+	// Data held back for delayed allocation can use the preallocated clusters
+	_FAT_file_flushDelayed (_REENT, file);
+	size = file->filesize + file->delayedLength;
+
+	if (size == 0) {
+		if (file->startCluster != CLUSTER_FREE) {
+			_FAT_fat_clearLinks (partition, file->startCluster);
+			file->startCluster = CLUSTER_FREE;
+			file->rwPosition.cluster = CLUSTER_FREE;
+			file->appendPosition.cluster = CLUSTER_FREE;
+			file->hintPosition.cluster = CLUSTER_FREE;
+			file->modified = true;
+		}
+	} else {
+		_FAT_fat_trimChain (partition, file->startCluster, ((size - 1) / partition->bytesPerCluster) + 1);
+	}
+}
+
+int fatPreallocate (int fd, uint32_t size) {
+	FILE_STRUCT* file = _FAT_file_fromFd (fd);
+	PARTITION* partition;
+
+	if ((file == NULL) || !file->inUse || !file->write) {
+		errno = EBADF;
+		return -1;
+	}
+
+	partition = file->partition;
+	_FAT_lock(&partition->lock);
+
+	// Held back data goes first, so that it is given the start of the clusters
+	if (!_FAT_file_flushDelayed (_REENT, file)) {
+		_FAT_unlock(&partition->lock);
+		errno = _REENT->_errno;
+		return -1;
+	}
+
+	if (!_FAT_file_allocateTo (file, size)) {
+		_FAT_unlock(&partition->lock);
+		errno = ENOSPC;
+		return -1;
+	}
+
+	_FAT_unlock(&partition->lock);
+
+	return 0;
+}
+
+/*
+Add up the lengths of the segments of a vectored read or write.
+Returns -1 if there are too many segments or they add up to more than
+ssize_t can hold
+*/
+static ssize_t _FAT_file_vectorLength (const FAT_IOVEC* iov, int iovcnt) {
+	size_t total = 0;
+	int i;
+
+	if ((iov == NULL) || (iovcnt < 0) || (iovcnt > FAT_IOV_MAX)) {
+		return -1;
+	}
+
+	for (i = 0; i < iovcnt; i++) {
+		if (iov[i].iov_len > (size_t)SSIZE_MAX - total) {
+			return -1;
+		}
+		total += iov[i].iov_len;
+	}
+
+	return total;
+}
+
+ssize_t fatReadv (int fd, const FAT_IOVEC* iov, int iovcnt) {
+	FILE_STRUCT* file = _FAT_file_fromFd (fd);
+	PARTITION* partition;
+	ssize_t total = 0;
+	ssize_t ret = 0;
+	int i;
+
+	if ((file == NULL) || !file->inUse || !file->read) {
+		errno = EBADF;
+		return -1;
+	}
+	if (_FAT_file_vectorLength (iov, iovcnt) < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	partition = file->partition;
+	_FAT_lock(&partition->lock);
+
+	for (i = 0; i < iovcnt; i++) {
+		if (iov[i].iov_len == 0) {
+			continue;
+		}
+		ret = _FAT_file_read (_REENT, file, (char*)iov[i].iov_base, iov[i].iov_len);
+		if (ret < 0) {
+			break;
+		}
+		total += ret;
+		if ((size_t)ret < iov[i].iov_len) {
+			// Reached the end of the file
+			break;
+		}
+	}
+
+	_FAT_unlock(&partition->lock);
+
+	if ((ret < 0) && (total == 0)) {
+		errno = _REENT->_errno;
+		return -1;
+	}
+	return total;
+}
+
+ssize_t fatWritev (int fd, const FAT_IOVEC* iov, int iovcnt) {
+	FILE_STRUCT* file = _FAT_file_fromFd (fd);
+	PARTITION* partition;
+	uint8_t* gather = NULL;
+	size_t gatherSize, gathered = 0;
+	ssize_t total = 0;
+	ssize_t ret = 0;
+	size_t wanted;
+	int i;
+
+	if ((file == NULL) || !file->inUse || !file->write) {
+		errno = EBADF;
+		return -1;
+	}
+	if (_FAT_file_vectorLength (iov, iovcnt) < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	partition = file->partition;
+
+	// Small segments are copied together, so that they are written with as few
+	// disc writes as possible. A cache page worth is enough to make that so.
+	gatherSize = partition->cache->sectorsPerPage * partition->bytesPerSector;
+	if (iovcnt > 1) {
+		gather = (uint8_t*) _FAT_mem_allocate (gatherSize);
+	}
+
+	_FAT_lock(&partition->lock);
+
+	for (i = 0; i <= iovcnt; i++) {
+		// Write out what has been gathered before a segment that won't fit with it
+		if ((gathered > 0) && ((i == iovcnt) || (gathered + iov[i].iov_len > gatherSize))) {
+			ret = _FAT_file_writeAtPosition (_REENT, file, (const char*)gather, gathered);
+			if (ret > 0) {
+				total += ret;
+			}
+			if ((size_t)ret != gathered) {
+				break;
+			}
+			gathered = 0;
+		}
+
+		if ((i == iovcnt) || (iov[i].iov_len == 0)) {
+			continue;
+		}
+
+		if ((gather != NULL) && (iov[i].iov_len < gatherSize)) {
+			memcpy (gather + gathered, iov[i].iov_base, iov[i].iov_len);
+			gathered += iov[i].iov_len;
+		} else {
+			wanted = iov[i].iov_len;
+			ret = _FAT_file_writeAtPosition (_REENT, file, (const char*)iov[i].iov_base, wanted);
+			if (ret > 0) {
+				total += ret;
+			}
+			if ((size_t)ret != wanted) {
+				break;
+			}
+		}
+	}
+
+	_FAT_unlock(&partition->lock);
+
+	if (gather) {
+		_FAT_mem_free (gather);
+	}
+
+	if ((ret < 0) && (total == 0)) {
+		errno = _REENT->_errno;
+		return -1;
+	}
+	return total;
+}
+
+ssize_t _FAT_file_pread (FILE_STRUCT* file, void* buf, size_t len, off_t offset) {
+	PARTITION* partition;
+	FILE_POSITION position;
+	ssize_t ret;
+
+	if ((file == NULL) || !file->inUse || !file->read) {
+		errno = EBADF;
+		return -1;
+	}
+	if ((offset < 0) || ((sizeof(offset) > 4) && (offset > (off_t)FILE_MAX_SIZE))) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (len == 0) {
+		return 0;
+	}
+
+	partition = file->partition;
+	_FAT_lock(&partition->lock);
+
+	// Data held back for delayed allocation has to be written before it can be read
+	if (!_FAT_file_flushDelayed (_REENT, file)) {
+		_FAT_unlock(&partition->lock);
+		errno = _REENT->_errno;
+		return -1;
+	}
+
+	// Nothing to read at or past the end of the file
+	if (((uint32_t)offset >= file->filesize) || (file->startCluster == CLUSTER_FREE)) {
+		_FAT_unlock(&partition->lock);
+		return 0;
+	}
+
+	if (!_FAT_file_positionAt (file, (uint32_t)offset, &position)) {
+		_FAT_unlock(&partition->lock);
+		errno = EIO;
+		return -1;
+	}
+
+	// Read from a private position, leaving the file's own alone
+	ret = _FAT_file_readAt (_REENT, file, &position, (uint32_t)offset, (char*)buf, len);
+	if (ret > 0) {
+		file->hintPosition = position;
+		file->hintOffset = (uint32_t)offset + ret;
+	}
+
+	_FAT_unlock(&partition->lock);
+
+	if (ret < 0) {
+		errno = _REENT->_errno;
+	}
+	return ret;
+}
+
+ssize_t _FAT_file_pwrite (FILE_STRUCT* file, const void* buf, size_t len, off_t offset) {
+	PARTITION* partition;
+	FILE_POSITION position, savedPosition;
+	uint32_t savedOffset, oldSize, oldStart;
+	bool savedAppend;
+	ssize_t ret;
+
+	if ((file == NULL) || !file->inUse || !file->write) {
+		errno = EBADF;
+		return -1;
+	}
+	if ((offset < 0) || ((sizeof(offset) > 4) && (offset > (off_t)FILE_MAX_SIZE))) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (len == 0) {
+		return 0;
+	}
+
+	partition = file->partition;
+	_FAT_lock(&partition->lock);
+
+	// Held back data goes first, so that it ends up before anything written past it
+	if (!_FAT_file_flushDelayed (_REENT, file)) {
+		_FAT_unlock(&partition->lock);
+		errno = _REENT->_errno;
+		return -1;
+	}
+
+	savedPosition = file->rwPosition;
+	savedOffset = file->currentPosition;
+	savedAppend = file->append;
+	oldSize = file->filesize;
+	oldStart = file->startCluster;
+
+	// Write from a private position. Past the end of the file, the write extends
+	// the file to offset first, which finds its own position.
+	if (((uint32_t)offset <= file->filesize) && (file->startCluster != CLUSTER_FREE)) {
+		if (!_FAT_file_positionAt (file, (uint32_t)offset, &position)) {
+			_FAT_unlock(&partition->lock);
+			errno = EIO;
+			return -1;
+		}
+		file->rwPosition = position;
+	}
+	file->currentPosition = (uint32_t)offset;
+	file->append = false;
+
+	ret = _FAT_file_write (_REENT, file, (const char*)buf, len);
+	if (ret > 0) {
+		file->hintPosition = file->rwPosition;
+		file->hintOffset = file->currentPosition;
+	}
+
+	// Put back the file's own positions
+	file->append = savedAppend;
+	file->rwPosition = savedPosition;
+	file->currentPosition = savedOffset;
+
+	if ((oldStart == CLUSTER_FREE) && (file->startCluster != CLUSTER_FREE)) {
+		// The read/write position was set before the file had any clusters
+		file->rwPosition.cluster = CLUSTER_FREE;
+		if ((savedOffset > file->filesize) ||
+			!_FAT_file_positionAt (file, savedOffset, &file->rwPosition))
+		{
+			file->rwPosition.cluster = file->startCluster;
+			file->rwPosition.sector = 0;
+			file->rwPosition.byte = 0;
+		}
+	}
+
+	if (file->append && ((file->filesize != oldSize) || (oldStart == CLUSTER_FREE))) {
+		// Appending carries on from the new end of the file
+		_FAT_file_positionAt (file, file->filesize, &file->appendPosition);
+	}
+
+	_FAT_unlock(&partition->lock);
+
+	if (ret < 0) {
+		errno = _REENT->_errno;
+	}
+	return ret;
+}
+
+ssize_t fatPread (int fd, void* buf, size_t len, off_t offset) {
+	return _FAT_file_pread (_FAT_file_fromFd (fd), buf, len, offset);
+}
+
+ssize_t fatPwrite (int fd, const void* buf, size_t len, off_t offset) {
+	return _FAT_file_pwrite (_FAT_file_fromFd (fd), buf, len, offset);
+}
+
+int fatGetFileExtents (int fd, off_t offset, size_t length, FAT_EXTENT* extents, int maxExtents) {
+	FILE_STRUCT* file = _FAT_file_fromFd (fd);
+	PARTITION* partition;
+	uint32_t end;
+	int found;
+	int i;
+
+	if ((file == NULL) || !file->inUse) {
+		errno = EBADF;
+		return -1;
+	}
+	if ((offset < 0) || ((sizeof(offset) > 4) && (offset > (off_t)FILE_MAX_SIZE)) ||
+		(extents == NULL) || (maxExtents < 0))
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+	partition = file->partition;
+	_FAT_lock(&partition->lock);
+
+	// Data held back for delayed allocation has no sectors until it is written
+	if (!_FAT_file_flushDelayed (_REENT, file)) {
+		_FAT_unlock(&partition->lock);
+		errno = _REENT->_errno;
+		return -1;
+	}
+
+	// Only the part of the range inside the file has sectors
+	if (((uint32_t)offset >= file->filesize) || (length == 0) || (file->startCluster == CLUSTER_FREE)) {
+		_FAT_unlock(&partition->lock);
+		return 0;
+	}
+	if (length > file->filesize - (uint32_t)offset) {
+		end = file->filesize;
+	} else {
+		end = (uint32_t)offset + length;
+	}
+
+	found = _FAT_file_mapRange (file, (uint32_t)offset, end, extents, maxExtents);
+	if (found < 0) {
+		_FAT_unlock(&partition->lock);
+		errno = EIO;
+		return -1;
+	}
+
+	// Whatever is waiting in the cache for these sectors has to reach the disc first
+	for (i = 0; i < found; i++) {
+		if (!_FAT_cache_flushSectors (partition->cache, extents[i].sector, extents[i].count)) {
+			_FAT_unlock(&partition->lock);
+			errno = EIO;
+			return -1;
+		}
+	}
+
+	_FAT_unlock(&partition->lock);
+
+	return found;
+}
+
+int fatSetWriteBehind (int fd, uint32_t size, uint32_t maxAge) {
+	FILE_STRUCT* file = _FAT_file_fromFd (fd);
+	PARTITION* partition;
+
+	if ((file == NULL) || !file->inUse || !file->write) {
+		errno = EBADF;
+		return -1;
+	}
+
+	partition = file->partition;
+	_FAT_lock(&partition->lock);
+
+	// The buffer is only replaced once everything in it has been written out
+	if (size != file->delayedSize) {
+		if (!_FAT_file_flushDelayed (_REENT, file)) {
+			_FAT_unlock(&partition->lock);
+			errno = _REENT->_errno;
+			return -1;
+		}
+		if (file->delayedData) {
+			_FAT_mem_free (file->delayedData);
+			file->delayedData = NULL;
+		}
+		file->delayedSize = size;
+	}
+	file->delayedMaxAge = maxAge;
+
+	_FAT_unlock(&partition->lock);
+
+	return 0;
+}
+
+int fatFlushAgedWrites (const char* name) {
+	PARTITION* partition;
+	FILE_STRUCT* file;
+	time_t now;
+	int ret = 0;
+
+	partition = _FAT_partition_getPartitionFromPath (name);
+	if (partition == NULL) {
+		errno = ENODEV;
+		return -1;
+	}
+
+	_FAT_lock(&partition->lock);
+
+	now = time (NULL);
+	for (file = partition->firstOpenFile; file != NULL; file = file->nextOpenFile) {
+		if (file->inUse && _FAT_file_delayedExpired (file, now)) {
+			int error = _FAT_syncToDisc (file);
+			if (error != 0) {
+				errno = error;
+				ret = -1;
+			}
+		}
+	}
+
+	_FAT_unlock(&partition->lock);
+
+	return ret;
+}
+
+/*
+Remember where offset is in the file's cluster chain, as fatPread and fatPwrite
+do, so that the next look along the file starts from there.
+offset must be less than the file size.
+*/
+static void _FAT_file_rememberPosition (FILE_STRUCT* file, uint32_t offset) {
+	FILE_POSITION position;
+
+	if (_FAT_file_positionAt (file, offset, &position)) {
+		file->hintPosition = position;
+		file->hintOffset = offset;
+	}
+}
+
+/*
+Returns true if both files were opened from the same directory entry
+*/
+static bool _FAT_file_sameEntry (const FILE_STRUCT* a, const FILE_STRUCT* b) {
+	return (a->dirEntryEnd.cluster == b->dirEntryEnd.cluster) &&
+		(a->dirEntryEnd.sector == b->dirEntryEnd.sector) &&
+		(a->dirEntryEnd.offset == b->dirEntryEnd.offset);
+}
+
+/*
+Copy the bytes from offset to end - 1 of src to the same place in dst, through
+buffer, which holds bufferSectors sectors -- at least the bytes to be copied,
+rounded up to a whole sector. offset must be at the start of a sector, and dst
+must be at least end bytes long. The copy stops short of end if either file is
+in more than COPY_EXTENTS pieces over the range.
+Returns the number of bytes copied, or 0 on failure.
+Does no locking of its own -- lock the partition before calling.
+*/
+static uint32_t _FAT_file_copyRange (FILE_STRUCT* src, FILE_STRUCT* dst, uint32_t offset, uint32_t end,
+	uint8_t* buffer, sec_t bufferSectors)
+{
+	PARTITION* partition = src->partition;
+	FAT_EXTENT extents[COPY_EXTENTS];
+	uint8_t* ptr;
+	uint8_t* run;
+	sec_t sectors, span, gap;
+	int found, i, j, k;
+
+	// Read the source straight from the disc, once anything waiting for it in the cache is there
+	found = _FAT_file_mapRange (src, offset, end, extents, COPY_EXTENTS);
+	if (found <= 0) {
+		return 0;
+	}
+	ptr = buffer;
+	sectors = 0;
+	for (i = 0; i < found; i = j) {
+		// Runs with no more than a cache page between them are read together, gap
+		// and all, as long as they fit in the buffer. The gaps are closed up after.
+		span = extents[i].count;
+		for (j = i + 1; j < found; j++) {
+			if (extents[j].sector < extents[j-1].sector + extents[j-1].count) {
+				break;
+			}
+			gap = extents[j].sector - (extents[j-1].sector + extents[j-1].count);
+			if ((gap > partition->cache->sectorsPerPage) ||
+				(sectors + span + gap + extents[j].count > bufferSectors))
+			{
+				break;
+			}
+			span += gap + extents[j].count;
+		}
+
+		if (!_FAT_cache_flushSectors (partition->cache, extents[i].sector, span) ||
+			!_FAT_disc_readSectors (partition->disc, extents[i].sector, span, ptr))
+		{
+			return 0;
+		}
+		run = ptr;
+		for (k = i; k < j; k++) {
+			if (k > i) {
+				memmove (ptr, run + (extents[k].sector - extents[i].sector) * partition->bytesPerSector,
+					extents[k].count * partition->bytesPerSector);
+			}
+			ptr += extents[k].count * partition->bytesPerSector;
+			sectors += extents[k].count;
+		}
+	}
+	if (sectors * partition->bytesPerSector < end - offset) {
+		end = offset + sectors * partition->bytesPerSector;
+	}
+
+	// Write it straight to the destination, bringing any cached copies of the sectors up to date
+	found = _FAT_file_mapRange (dst, offset, end, extents, COPY_EXTENTS);
+	if (found <= 0) {
+		return 0;
+	}
+	ptr = buffer;
+	sectors = 0;
+	for (i = 0; i < found; i++) {
+		if (!_FAT_disc_writeSectors (partition->disc, extents[i].sector, extents[i].count, ptr)) {
+			return 0;
+		}
+		_FAT_cache_updateSectors (partition->cache, extents[i].sector, extents[i].count, ptr);
+		ptr += extents[i].count * partition->bytesPerSector;
+		sectors += extents[i].count;
+	}
+	if (sectors * partition->bytesPerSector < end - offset) {
+		end = offset + sectors * partition->bytesPerSector;
+	}
+
+	return end - offset;
+}
+
+int fatCopyFileEx (const char* srcPath, const char* dstPath, uint32_t flags, FAT_COPY_CALLBACK progress, void* userData) {
+	PARTITION* partition;
+	FILE_STRUCT* src;
+	FILE_STRUCT* dst;
+	FILE_STRUCT* other;
+	uint8_t* buffer;
+	uint32_t bufferSize;
+	uint32_t size, offset, end, copied;
+	bool keepDestination = false;
+	int error = 0;
+
+	partition = _FAT_partition_getPartitionFromPath (srcPath);
+	if (partition == NULL) {
+		errno = ENODEV;
+		return -1;
+	}
+	if (_FAT_partition_getPartitionFromPath (dstPath) != partition) {
+		errno = EXDEV;
+		return -1;
+	}
+	if (flags & ~FAT_COPY_OVERWRITE) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	bufferSize = (COPY_BUFFER_SIZE / partition->bytesPerSector) * partition->bytesPerSector;
+	if (bufferSize == 0) {
+		bufferSize = partition->bytesPerSector;
+	}
+#ifdef LIMIT_SECTORS
+	if (bufferSize > LIMIT_SECTORS * partition->bytesPerSector) {
+		bufferSize = LIMIT_SECTORS * partition->bytesPerSector;
+	}
+#endif
+
+	src = (FILE_STRUCT*) _FAT_mem_allocate (sizeof(FILE_STRUCT));
+	dst = (FILE_STRUCT*) _FAT_mem_allocate (sizeof(FILE_STRUCT));
+	buffer = (uint8_t*) _FAT_mem_align (bufferSize);
+	if ((src == NULL) || (dst == NULL) || (buffer == NULL)) {
+		error = ENOMEM;
+		goto freeMemory;
+	}
+
+	if (_FAT_open_r (_REENT, src, srcPath, O_RDONLY, 0) == -1) {
+		error = _REENT->_errno;
+		goto freeMemory;
+	}
+	if (_FAT_open_r (_REENT, dst, dstPath, O_WRONLY | O_CREAT | ((flags & FAT_COPY_OVERWRITE) ? 0 : O_EXCL), 0) == -1) {
+		error = _REENT->_errno;
+		_FAT_close_r (_REENT, src);
+		goto freeMemory;
+	}
+
+	_FAT_lock(&partition->lock);
+
+	// The destination's old clusters may be being read with the partition unlocked
+	_FAT_partition_waitForTransfers (partition);
+
+	// Copying a file over itself would lose it
+	if (_FAT_file_sameEntry (src, dst)) {
+		_FAT_unlock(&partition->lock);
+		keepDestination = true;
+		error = EINVAL;
+		goto closeFiles;
+	}
+
+	// The source may be open for writing elsewhere, with changes its entry doesn't have
+	// yet and data held back that has to be on the disc to be copied from there
+	for (other = partition->firstOpenFile; other != NULL; other = other->nextOpenFile) {
+		if ((other != src) && other->inUse && other->write && _FAT_file_sameEntry (other, src)) {
+			if (!_FAT_file_flushDelayed (_REENT, other)) {
+				_FAT_unlock(&partition->lock);
+				error = _REENT->_errno;
+				goto closeFiles;
+			}
+			src->filesize = other->filesize;
+			src->startCluster = other->startCluster;
+			src->rwPosition.cluster = src->startCluster;
+			src->rwPosition.sector = 0;
+			src->rwPosition.byte = 0;
+			break;
+		}
+	}
+	size = src->filesize;
+
+	// Give back whatever the destination held before, then give it all of its clusters
+	// at once. It is as long as the source from the start, and anything not copied is
+	// given back when it is closed.
+	dst->filesize = 0;
+	dst->preallocated = true;
+	_FAT_file_releasePreallocated (dst);
+	dst->modified = true;
+	if (!_FAT_file_allocateTo (dst, size)) {
+		_FAT_unlock(&partition->lock);
+		error = ENOSPC;
+		goto closeFiles;
+	}
+	dst->filesize = size;
+	dst->preallocated = true;
+
+	_FAT_unlock(&partition->lock);
+
+	// Copy a buffer full at a time, letting other threads use the partition in between
+	for (offset = 0; offset < size; offset += copied) {
+		_FAT_lock(&partition->lock);
+
+		// The source may have been cut short since the last time round
+		if (src->filesize < size) {
+			size = src->filesize;
+			dst->filesize = size;
+			if (offset >= size) {
+				_FAT_unlock(&partition->lock);
+				break;
+			}
+		}
+
+		end = (size - offset > bufferSize) ? offset + bufferSize : size;
+		copied = _FAT_file_copyRange (src, dst, offset, end, buffer, bufferSize / partition->bytesPerSector);
+		if ((copied > 0) && (offset + copied < size)) {
+			_FAT_file_rememberPosition (src, offset + copied);
+			_FAT_file_rememberPosition (dst, offset + copied);
+		}
+
+		_FAT_unlock(&partition->lock);
+
+		if (copied == 0) {
+			error = EIO;
+			break;
+		}
+		if ((progress != NULL) && !progress (offset + copied, size, userData)) {
+			error = ECANCELED;
+			break;
+		}
+	}
+
+closeFiles:
+	_FAT_close_r (_REENT, src);
+	if ((_FAT_close_r (_REENT, dst) == -1) && (error == 0)) {
+		error = _REENT->_errno;
+	}
+	if ((error != 0) && !keepDestination) {
+		_FAT_unlink_r (_REENT, dstPath);
+	}
+
+freeMemory:
+	_FAT_mem_free (buffer);
+	_FAT_mem_free (dst);
+	_FAT_mem_free (src);
+
+	if (error != 0) {
+		errno = error;
+		return -1;
+	}
+	return 0;
+}
+
+int fatCopyFile (const char* src, const char* dst, uint32_t flags) {
+	return fatCopyFileEx (src, dst, flags, NULL, NULL);
+}
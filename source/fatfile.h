@@ -34,6 +34,7 @@
 
 #include <sys/reent.h>
 #include <sys/stat.h>
+#include <time.h>
 
 #include "common.h"
 #include "partition.h"
@@ -41,6 +42,13 @@
 
 #define FILE_MAX_SIZE ((uint32_t)0xFFFFFFFF)	// 4GiB - 1B
 
+// Most runs of sectors read ahead of a file at a time
+#define READ_AHEAD_EXTENTS 8
+
+// Bytes moved at a time by fatCopyFile, and the most runs of sectors they can be in
+#define COPY_BUFFER_SIZE (64 * 1024)
+#define COPY_EXTENTS 32
+
 typedef struct {
 	u32   cluster;
 	sec_t sector;
@@ -55,8 +63,18 @@ struct _FILE_STRUCT {
 	uint32_t             currentPosition;
 	FILE_POSITION        rwPosition;
 	FILE_POSITION        appendPosition;
+	FILE_POSITION        hintPosition;		// Where fatPread or fatPwrite last finished, unused if the cluster is CLUSTER_FREE
+	uint32_t             hintOffset;		// The offset into the file of hintPosition
 	DIR_ENTRY_POSITION   dirEntryStart;		// Points to the start of the LFN entries of a file, or the alias for no LFN
 	DIR_ENTRY_POSITION   dirEntryEnd;		// Always points to the file's alias entry
+	uint8_t*             delayedData;		// Data written to the end of the file but not yet given clusters, or NULL
+	uint32_t             delayedLength;		// Bytes held in delayedData, which follow on from filesize
+	uint32_t             delayedSize;		// Bytes the file may hold back, 0 if it writes straight through
+	uint32_t             delayedMaxAge;		// Seconds data may be held back before it is written out, 0 for no limit
+	time_t               delayedSince;		// When the first of the bytes in delayedData was written
+	uint32_t             readAheadNext;		// Where a read carrying on from the last one would start
+	uint32_t             readAheadEnd;		// How far into the file has been loaded into the cache ahead of reading
+	uint32_t             readAheadWindow;	// Clusters to read ahead, 0 when the file isn't being read straight through
 	PARTITION*           partition;
 	struct _FILE_STRUCT* prevOpenFile;		// The previous entry in a double-linked list of open files
 	struct _FILE_STRUCT* nextOpenFile;		// The next entry in a double-linked list of open files
@@ -65,6 +83,7 @@ struct _FILE_STRUCT {
 	bool                 append;
 	bool                 inUse;
 	bool                 modified;
+	bool                 preallocated;		// The cluster chain may go on past the end of the file, from fatPreallocate, delayed allocation or O_TRUNC
 };
 
 typedef struct _FILE_STRUCT FILE_STRUCT;
@@ -93,6 +112,25 @@ int _FAT_ftruncate_r (struct _reent *r, void *fd, off_t len);
 
 int _FAT_fsync_r (struct _reent *r, void *fd);
 
+/*
+Get the file opened on the FAT device as file descriptor fd.
+Returns NULL if fd isn't a file on a FAT device.
+*/
+FILE_STRUCT* _FAT_file_fromFd (int fd);
+
+/*
+Give back the clusters preallocated past the end of the file.
+Does no locking of its own -- lock the partition before calling.
+*/
+void _FAT_file_releasePreallocated (FILE_STRUCT* file);
+
+/*
+fatPread and fatPwrite for a file that has already been looked up.
+Returns the number of bytes transferred, or -1 with errno set.
+*/
+ssize_t _FAT_file_pread (FILE_STRUCT* file, void* buf, size_t len, off_t offset);
+ssize_t _FAT_file_pwrite (FILE_STRUCT* file, const void* buf, size_t len, off_t offset);
+
 /*
 Synchronizes the file data to disc.
 Does no locking of its own -- lock the partition before calling.
@@ -31,299 +31,1513 @@
 #include "file_allocation_table.h"
 #include "partition.h"
 #include "mem_allocate.h"
+#include "bit_ops.h"
+#include "lock.h"
+#include "discard.h"
 #include <string.h>
 
+/*
+The kernels below take the FAT type as a constant argument. They are always
+inlined into a copy for each FAT type, so the type checks are resolved at
+compile time, and the copies are reached through the partition's function table.
+*/
+#define FAT_KERNEL static inline __attribute__((always_inline))
+
+// Counting free clusters reads this many FAT sectors at a time
+#ifdef LIMIT_SECTORS
+ #define FAT_SCAN_SECTORS LIMIT_SECTORS
+#else
+ #define FAT_SCAN_SECTORS 64
+#endif
+
+// Number of ranges the FAT is split into to count free clusters in parallel,
+// and the smallest FAT worth splitting
+#define FAT_SCAN_THREADS 4
+#define FAT_SCAN_THREAD_MIN_CLUSTERS 0x10000
+
+typedef struct {
+	PARTITION* partition;
+	uint32_t   firstCluster;
+	uint32_t   lastCluster;
+	uint32_t   freeCount;		// CLUSTER_ERROR if the range couldn't be read
+} FAT_SCAN_RANGE;
+
+// Runs of at least this many clusters are allocated from the best fitting free extent
+#define BEST_FIT_MIN_CLUSTERS 16
+
+// Number of the largest free extents kept in the free extent index
+#define FREE_INDEX_EXTENTS 64
+
+typedef struct {
+	uint32_t firstCluster;
+	uint32_t length;
+} FREE_EXTENT;
+
+/*
+The largest runs of free clusters, in order of their first cluster. It is
+built by scanning the FAT and kept up to date as clusters are allocated.
+Freeing clusters makes it out of date until the next time it is built.
+*/
+struct _FREE_INDEX {
+	bool         valid;
+	unsigned int count;
+	FREE_EXTENT  extents[FREE_INDEX_EXTENTS];
+};
+
+/*
+Byte offset of a cluster's entry from the start of the FAT
+*/
+FAT_KERNEL uint32_t _FAT_fat_entryOffset (const FS_TYPE type, uint32_t cluster) {
+	switch (type) {
+		case FS_FAT12:
+			return cluster + (cluster >> 1);
+		case FS_FAT16:
+			return cluster << 1;
+		default:
+			return cluster << 2;
+	}
+}
+
+/*
+Work out the sector of the active FAT that holds a cluster's entry,
+and the entry's offset within that sector
+*/
+FAT_KERNEL sec_t _FAT_fat_entrySector (PARTITION* partition, const FS_TYPE type, uint32_t cluster, unsigned int* offset) {
+	uint32_t fatOffset = _FAT_fat_entryOffset (type, cluster);
+
+	*offset = fatOffset & (partition->bytesPerSector - 1);
+	return partition->fat.fatStart + (fatOffset >> partition->fat.sectorShift);
+}
+
+/*
+Returns true if the cluster's FAT entry can be accessed within a single
+sector. Only FAT12 entries can be split across two sectors.
+*/
+FAT_KERNEL bool _FAT_fat_entryInSector (PARTITION* partition, const FS_TYPE type, unsigned int offset) {
+	return (type != FS_FAT12) || (offset != partition->bytesPerSector - 1);
+}
+
+/*
+Decode a cluster's FAT entry from the sector data that contains it
+*/
+FAT_KERNEL uint32_t _FAT_fat_decodeEntry (const FS_TYPE type, const uint8_t* fatData, unsigned int offset, uint32_t cluster) {
+	uint32_t value;
+
+	switch (type) {
+		case FS_FAT12:
+			// Both halves of the 12 bit entry are read together
+			value = u8array_to_u16 (fatData, offset);
+			if (cluster & 0x01) {
+				value = value >> 4;
+			} else {
+				value &= 0x0FFF;
+			}
+			if (value >= 0x0FF7) {
+				value = CLUSTER_EOF;
+			}
+			break;
+		case FS_FAT16:
+			value = u8array_to_u16 (fatData, offset);
+			if (value >= 0xFFF7) {
+				value = CLUSTER_EOF;
+			}
+			break;
+		default:
+			value = u8array_to_u32 (fatData, offset);
+			if (value >= 0x0FFFFFF7) {
+				value = CLUSTER_EOF;
+			}
+			break;
+	}
+
+	return value;
+}
+
+/*
+Encode a value into a cluster's FAT entry within the sector data that contains it
+*/
+FAT_KERNEL void _FAT_fat_encodeEntry (const FS_TYPE type, uint8_t* fatData, unsigned int offset, uint32_t cluster, uint32_t value) {
+	switch (type) {
+		case FS_FAT12:
+			if (cluster & 0x01) {
+				fatData[offset] = (fatData[offset] & 0x0F) | ((value << 4) & 0xF0);
+				fatData[offset + 1] = (value >> 4) & 0xFF;
+			} else {
+				fatData[offset] = value & 0xFF;
+				fatData[offset + 1] = (fatData[offset + 1] & 0xF0) | ((value >> 8) & 0x0F);
+			}
+			break;
+		case FS_FAT16:
+			u16_to_u8array (fatData, offset, value);
+			break;
+		default:
+			u32_to_u8array (fatData, offset, value);
+			break;
+	}
+}
+
+/*
+Remember that a sector of the active FAT has changed, so that it
+gets copied to the backup FATs
+*/
+static inline void _FAT_fat_markSectorDirty (PARTITION* partition, sec_t sector) {
+	uint32_t fatSector = sector - partition->fat.fatStart;
+
+	if (partition->fat.dirtySectors && (fatSector < partition->fat.sectorsPerFat)) {
+		partition->fat.dirtySectors[fatSector / 32] |= 1u << (fatSector % 32);
+	}
+}
+
+/*
+Read a FAT12 entry that starts in the last byte of sector and ends in the
+first byte of the next one
+*/
+static uint32_t _FAT_fat_readSplitEntry (PARTITION* partition, sec_t sector, uint32_t cluster) {
+	const uint8_t* fatData;
+	uint32_t value;
+
+	fatData = _FAT_cache_peekSector (partition->cache, sector);
+	if (fatData == NULL) {
+		return CLUSTER_ERROR;
+	}
+	value = fatData[partition->bytesPerSector - 1];
+
+	fatData = _FAT_cache_peekSector (partition->cache, sector + 1);
+	if (fatData == NULL) {
+		return CLUSTER_ERROR;
+	}
+	value |= fatData[0] << 8;
+
+	if (cluster & 0x01) {
+		value = value >> 4;
+	} else {
+		value &= 0x0FFF;
+	}
+	if (value >= 0x0FF7) {
+		value = CLUSTER_EOF;
+	}
+
+	return value;
+}
+
+/*
+Write a FAT12 entry that starts in the last byte of sector and ends in the
+first byte of the next one
+*/
+static bool _FAT_fat_writeSplitEntry (PARTITION* partition, sec_t sector, uint32_t cluster, uint32_t value) {
+	unsigned int last = partition->bytesPerSector - 1;
+	uint8_t* fatData;
+
+	fatData = _FAT_cache_modifySector (partition->cache, sector);
+	if (fatData == NULL) {
+		return false;
+	}
+	if (cluster & 0x01) {
+		fatData[last] = (fatData[last] & 0x0F) | ((value << 4) & 0xF0);
+	} else {
+		fatData[last] = value & 0xFF;
+	}
+	_FAT_fat_markSectorDirty (partition, sector);
+
+	// The first sector may not still be cached after this
+	fatData = _FAT_cache_modifySector (partition->cache, sector + 1);
+	if (fatData == NULL) {
+		return false;
+	}
+	if (cluster & 0x01) {
+		fatData[0] = (value >> 4) & 0xFF;
+	} else {
+		fatData[0] = (fatData[0] & 0xF0) | ((value >> 8) & 0x0F);
+	}
+	_FAT_fat_markSectorDirty (partition, sector + 1);
+
+	return true;
+}
+
 /*
 Gets the cluster linked from input cluster
 */
-uint32_t _FAT_fat_nextCluster(PARTITION* partition, uint32_t cluster)
+FAT_KERNEL uint32_t _FAT_fat_nextClusterOfType (PARTITION* partition, uint32_t cluster, const FS_TYPE type) {
+	const uint8_t* fatData;
+	unsigned int offset;
+	sec_t sector;
+
+	if (cluster == CLUSTER_FREE) {
+		return CLUSTER_FREE;
+	}
+	if (cluster > partition->fat.lastCluster) {
+		return CLUSTER_ERROR;
+	}
+
+	sector = _FAT_fat_entrySector (partition, type, cluster, &offset);
+	if (!_FAT_fat_entryInSector (partition, type, offset)) {
+		return _FAT_fat_readSplitEntry (partition, sector, cluster);
+	}
+
+	fatData = _FAT_cache_peekSector (partition->cache, sector);
+	if (fatData == NULL) {
+		return CLUSTER_ERROR;
+	}
+
+	return _FAT_fat_decodeEntry (type, fatData, offset, cluster);
+}
+
+/*
+writes value into the correct offset within a partition's FAT, based
+on the cluster number.
+*/
+FAT_KERNEL bool _FAT_fat_writeEntryOfType (PARTITION* partition, uint32_t cluster, uint32_t value, const FS_TYPE type) {
+	uint8_t* fatData;
+	unsigned int offset;
+	sec_t sector;
+
+	if ((cluster < CLUSTER_FIRST) || (cluster > partition->fat.lastCluster /* This will catch CLUSTER_ERROR */))
+	{
+		return false;
+	}
+
+	sector = _FAT_fat_entrySector (partition, type, cluster, &offset);
+	if (!_FAT_fat_entryInSector (partition, type, offset)) {
+		return _FAT_fat_writeSplitEntry (partition, sector, cluster, value);
+	}
+
+	fatData = _FAT_cache_modifySector (partition->cache, sector);
+	if (fatData == NULL) {
+		return false;
+	}
+
+	_FAT_fat_encodeEntry (type, fatData, offset, cluster, value);
+	_FAT_fat_markSectorDirty (partition, sector);
+
+	return true;
+}
+
+/*
+Read a cluster's FAT entry while scanning the FAT. The sector data from the
+previous call is reused when the entry is in the same sector, so set *fatData
+to NULL before the first call.
+Returns CLUSTER_ERROR if the FAT can't be read
+*/
+FAT_KERNEL uint32_t _FAT_fat_scanEntryOfType (PARTITION* partition, uint32_t cluster, const uint8_t** fatData, sec_t* fatDataSector,
+	const FS_TYPE type)
 {
-	uint32_t nextCluster = CLUSTER_FREE;
+	unsigned int offset;
 	sec_t sector;
-	int offset;
 
+	sector = _FAT_fat_entrySector (partition, type, cluster, &offset);
+
+	if (!_FAT_fat_entryInSector (partition, type, offset)) {
+		*fatData = NULL;
+		return _FAT_fat_readSplitEntry (partition, sector, cluster);
+	}
+
+	if ((*fatData == NULL) || (sector != *fatDataSector)) {
+		*fatData = _FAT_cache_peekSector (partition->cache, sector);
+		*fatDataSector = sector;
+		if (*fatData == NULL) {
+			return CLUSTER_ERROR;
+		}
+	}
+
+	return _FAT_fat_decodeEntry (type, *fatData, offset, cluster);
+}
+
+/*
+As _FAT_fat_scanEntryOfType, for the less frequently used scans that aren't
+specialised for each FAT type. Reads the in-memory FAT if there is one.
+*/
+static uint32_t _FAT_fat_scanEntry (PARTITION* partition, uint32_t cluster, const uint8_t** fatData, sec_t* fatDataSector) {
+	if (partition->fat.table) {
+		return partition->fat.table[cluster];
+	}
+
+	switch (partition->filesysType) {
+		case FS_FAT12:
+			return _FAT_fat_scanEntryOfType (partition, cluster, fatData, fatDataSector, FS_FAT12);
+		case FS_FAT16:
+			return _FAT_fat_scanEntryOfType (partition, cluster, fatData, fatDataSector, FS_FAT16);
+		case FS_FAT32:
+			return _FAT_fat_scanEntryOfType (partition, cluster, fatData, fatDataSector, FS_FAT32);
+		default:
+			return CLUSTER_ERROR;
+	}
+}
+
+/*
+Follow a cluster chain, see _FAT_fat_followChain
+*/
+FAT_KERNEL uint32_t _FAT_fat_followChainOfType (PARTITION* partition, uint32_t* cluster, uint32_t* nextCluster,
+	uint32_t maxLinks, bool contiguous, const FS_TYPE type)
+{
+	const uint8_t* fatData = NULL;
+	sec_t fatDataSector = 0;
+	uint32_t curCluster = *cluster;
+	uint32_t next;
+	uint32_t links = 0;
+
+	for (;;) {
+		if (!_FAT_fat_isValidCluster (partition, curCluster)) {
+			next = _FAT_fat_nextClusterOfType (partition, curCluster, type);
+			break;
+		}
+
+		next = _FAT_fat_scanEntryOfType (partition, curCluster, &fatData, &fatDataSector, type);
+
+		if ((links >= maxLinks) || !_FAT_fat_isValidCluster (partition, next) ||
+			(contiguous && (next != curCluster + 1)))
+		{
+			break;
+		}
+
+		curCluster = next;
+		links++;
+	}
+
+	*cluster = curCluster;
+	*nextCluster = next;
+	return links;
+}
+
+/*
+Find the first free cluster at or after startCluster, wrapping around to
+the start of the FAT if needed. The FAT is scanned a whole cached sector
+at a time.
+Returns CLUSTER_ERROR if there are no free clusters
+*/
+FAT_KERNEL uint32_t _FAT_fat_findFreeClusterOfType (PARTITION* partition, uint32_t startCluster, const FS_TYPE type) {
+	const uint8_t* fatData = NULL;
+	sec_t fatDataSector = 0;
+	uint32_t lastCluster = partition->fat.lastCluster;
+	uint32_t curCluster;
+	uint32_t clustersLeft;
+	uint32_t value;
+
+	if ((startCluster < CLUSTER_FIRST) || (startCluster > lastCluster)) {
+		startCluster = CLUSTER_FIRST;
+	}
+
+	curCluster = startCluster;
+	for (clustersLeft = lastCluster - CLUSTER_FIRST + 1; clustersLeft > 0; clustersLeft--) {
+		value = _FAT_fat_scanEntryOfType (partition, curCluster, &fatData, &fatDataSector, type);
+		if (value == CLUSTER_ERROR) {
+			return CLUSTER_ERROR;
+		}
+
+		if (value == CLUSTER_FREE) {
+			return curCluster;
+		}
+
+		curCluster++;
+		if (curCluster > lastCluster) {
+			// Try looping back to the beginning of the FAT
+			// This was suggested by loopy
+			curCluster = CLUSTER_FIRST;
+		}
+	}
+
+	return CLUSTER_ERROR;
+}
+
+/*
+Free every cluster in the chain starting at cluster, a whole cached FAT
+sector at a time. *clustersFreed, *lowestCluster and *lastCluster are set
+to the number of clusters freed, the lowest of them and the last one.
+Returns false if the FAT couldn't be updated
+*/
+FAT_KERNEL bool _FAT_fat_freeChainOfType (PARTITION* partition, uint32_t cluster, uint32_t* clustersFreed,
+	uint32_t* lowestCluster, uint32_t* lastCluster, const FS_TYPE type)
+{
+	uint8_t* fatData = NULL;
+	sec_t fatDataSector = 0;
+	uint32_t nextCluster;
+	unsigned int offset;
+	sec_t sector;
+
+	*clustersFreed = 0;
+	*lowestCluster = cluster;
+	*lastCluster = cluster;
+
+	while (_FAT_fat_isValidCluster (partition, cluster)) {
+		sector = _FAT_fat_entrySector (partition, type, cluster, &offset);
+
+		if (!_FAT_fat_entryInSector (partition, type, offset)) {
+			// Store next cluster before erasing the link
+			nextCluster = _FAT_fat_readSplitEntry (partition, sector, cluster);
+			if (!_FAT_fat_writeSplitEntry (partition, sector, cluster, CLUSTER_FREE)) {
+				return false;
+			}
+			fatData = NULL;
+		} else {
+			if ((fatData == NULL) || (sector != fatDataSector)) {
+				fatData = _FAT_cache_modifySector (partition->cache, sector);
+				fatDataSector = sector;
+				if (fatData == NULL) {
+					return false;
+				}
+				_FAT_fat_markSectorDirty (partition, sector);
+			}
+			// Store next cluster before erasing the link
+			nextCluster = _FAT_fat_decodeEntry (type, fatData, offset, cluster);
+			_FAT_fat_encodeEntry (type, fatData, offset, cluster, CLUSTER_FREE);
+		}
+
+		if (partition->discard) {
+			_FAT_discard_freed (partition, cluster);
+		}
+
+		if (cluster < *lowestCluster) {
+			*lowestCluster = cluster;
+		}
+		*lastCluster = cluster;
+		(*clustersFreed)++;
+
+		// Move onto next cluster
+		cluster = nextCluster;
+	}
+
+	return true;
+}
+
+/*
+Count the free clusters from firstCluster to lastCluster. The FAT is read
+straight from the disc, FAT_SCAN_SECTORS at a time, into a buffer of its
+own rather than through the cache, so several ranges can be counted at once.
+If table isn't NULL, each decoded entry is also stored in it, indexed by cluster.
+Returns CLUSTER_ERROR if the FAT couldn't be read
+*/
+FAT_KERNEL uint32_t _FAT_fat_countFreeRangeOfType (PARTITION* partition, uint32_t firstCluster, uint32_t lastCluster,
+	uint32_t* table, const FS_TYPE type)
+{
+	uint32_t value;
+	const uint32_t entrySize = (type == FS_FAT32) ? 4 : 2;	// Bytes read to decode an entry
+	uint32_t windowStart = 0;		// Byte offsets within the FAT of the sectors in the buffer
+	uint32_t windowEnd = 0;
+	uint32_t windowSectors;
+	uint32_t fatOffset;
+	uint32_t count = 0;
+	uint32_t curCluster;
+	uint8_t* buffer;
+
+	buffer = (uint8_t*) _FAT_mem_align (FAT_SCAN_SECTORS * partition->bytesPerSector);
+	if (buffer == NULL) {
+		return CLUSTER_ERROR;
+	}
+
+	for (curCluster = firstCluster; curCluster <= lastCluster; curCluster++) {
+		fatOffset = _FAT_fat_entryOffset (type, curCluster);
+
+		if ((fatOffset < windowStart) || (fatOffset + entrySize > windowEnd)) {
+			windowSectors = FAT_SCAN_SECTORS;
+			if ((fatOffset >> partition->fat.sectorShift) + windowSectors > partition->fat.sectorsPerFat) {
+				windowSectors = partition->fat.sectorsPerFat - (fatOffset >> partition->fat.sectorShift);
+			}
+			windowStart = (fatOffset >> partition->fat.sectorShift) << partition->fat.sectorShift;
+			windowEnd = windowStart + (windowSectors << partition->fat.sectorShift);
+			if ((fatOffset >> partition->fat.sectorShift >= partition->fat.sectorsPerFat) ||
+				(fatOffset + entrySize > windowEnd) ||
+				!_FAT_disc_readSectors (partition->disc, partition->fat.fatStart + (fatOffset >> partition->fat.sectorShift),
+					windowSectors, buffer))
+			{
+				count = CLUSTER_ERROR;
+				break;
+			}
+		}
+
+		value = _FAT_fat_decodeEntry (type, buffer, fatOffset - windowStart, curCluster);
+		if (table) {
+			table[curCluster] = value;
+		}
+		if (value == CLUSTER_FREE) {
+			count++;
+		}
+	}
+
+	_FAT_mem_free (buffer);
+	return count;
+}
+
+/*
+Generate the copy of each kernel for one FAT type, and a function table
+pointing at them
+*/
+#define FAT_FUNCTIONS_FOR_TYPE(bits) \
+static uint32_t _FAT_fat_nextCluster##bits (PARTITION* partition, uint32_t cluster) { \
+	return _FAT_fat_nextClusterOfType (partition, cluster, FS_FAT##bits); \
+} \
+static bool _FAT_fat_writeEntry##bits (PARTITION* partition, uint32_t cluster, uint32_t value) { \
+	return _FAT_fat_writeEntryOfType (partition, cluster, value, FS_FAT##bits); \
+} \
+static uint32_t _FAT_fat_followChain##bits (PARTITION* partition, uint32_t* cluster, uint32_t* nextCluster, uint32_t maxLinks, bool contiguous) { \
+	return _FAT_fat_followChainOfType (partition, cluster, nextCluster, maxLinks, contiguous, FS_FAT##bits); \
+} \
+static uint32_t _FAT_fat_findFreeCluster##bits (PARTITION* partition, uint32_t startCluster) { \
+	return _FAT_fat_findFreeClusterOfType (partition, startCluster, FS_FAT##bits); \
+} \
+static bool _FAT_fat_freeChain##bits (PARTITION* partition, uint32_t cluster, uint32_t* clustersFreed, uint32_t* lowestCluster, uint32_t* lastCluster) { \
+	return _FAT_fat_freeChainOfType (partition, cluster, clustersFreed, lowestCluster, lastCluster, FS_FAT##bits); \
+} \
+static uint32_t _FAT_fat_countFreeRange##bits (PARTITION* partition, uint32_t firstCluster, uint32_t lastCluster) { \
+	return _FAT_fat_countFreeRangeOfType (partition, firstCluster, lastCluster, NULL, FS_FAT##bits); \
+} \
+static const FAT_FUNCTIONS _FAT_fat_functions##bits = { \
+	_FAT_fat_nextCluster##bits, \
+	_FAT_fat_writeEntry##bits, \
+	_FAT_fat_followChain##bits, \
+	_FAT_fat_findFreeCluster##bits, \
+	_FAT_fat_freeChain##bits, \
+	_FAT_fat_countFreeRange##bits \
+};
+
+FAT_FUNCTIONS_FOR_TYPE(12)
+FAT_FUNCTIONS_FOR_TYPE(16)
+FAT_FUNCTIONS_FOR_TYPE(32)
+
+/*
+Put a value written to a FAT entry into the form it is read back as,
+so the in-memory FAT holds the same values the FAT sectors would give
+*/
+static inline uint32_t _FAT_fat_tableValue (PARTITION* partition, uint32_t value) {
+	switch (partition->filesysType) {
+		case FS_FAT12:
+			value &= 0x0FFF;
+			return (value >= 0x0FF7) ? CLUSTER_EOF : value;
+		case FS_FAT16:
+			value &= 0xFFFF;
+			return (value >= 0xFFF7) ? CLUSTER_EOF : value;
+		default:
+			return (value >= 0x0FFFFFF7) ? CLUSTER_EOF : value;
+	}
+}
+
+/*
+Remember that the FAT sector holding a cluster's entry is out of date
+with the in-memory FAT. A FAT12 entry can be split over two sectors.
+*/
+static inline void _FAT_fat_markTableDirty (PARTITION* partition, uint32_t cluster) {
+	uint32_t fatOffset = _FAT_fat_entryOffset (partition->filesysType, cluster);
+	uint32_t fatSector = fatOffset >> partition->fat.sectorShift;
+
+	partition->fat.tableDirty[fatSector / 32] |= 1u << (fatSector % 32);
+	if ((partition->filesysType == FS_FAT12) && ((fatOffset & (partition->bytesPerSector - 1)) == partition->bytesPerSector - 1)) {
+		fatSector++;
+		partition->fat.tableDirty[fatSector / 32] |= 1u << (fatSector % 32);
+	}
+}
+
+/*
+The FAT access functions for a FAT held in memory by _FAT_fat_loadTable.
+Each works the same as the kernel of the same name, but on the table
+instead of the cached FAT sectors.
+*/
+static uint32_t _FAT_fat_nextClusterInTable (PARTITION* partition, uint32_t cluster) {
 	if (cluster == CLUSTER_FREE) {
 		return CLUSTER_FREE;
 	}
+	if (cluster > partition->fat.lastCluster) {
+		return CLUSTER_ERROR;
+	}
+
+	return partition->fat.table[cluster];
+}
+
+static bool _FAT_fat_writeEntryInTable (PARTITION* partition, uint32_t cluster, uint32_t value) {
+	if ((cluster < CLUSTER_FIRST) || (cluster > partition->fat.lastCluster /* This will catch CLUSTER_ERROR */))
+	{
+		return false;
+	}
+
+	partition->fat.table[cluster] = _FAT_fat_tableValue (partition, value);
+	_FAT_fat_markTableDirty (partition, cluster);
+
+	return true;
+}
+
+static uint32_t _FAT_fat_followChainInTable (PARTITION* partition, uint32_t* cluster, uint32_t* nextCluster,
+	uint32_t maxLinks, bool contiguous)
+{
+	const uint32_t* table = partition->fat.table;
+	uint32_t curCluster = *cluster;
+	uint32_t next;
+	uint32_t links = 0;
+
+	for (;;) {
+		if (!_FAT_fat_isValidCluster (partition, curCluster)) {
+			next = _FAT_fat_nextClusterInTable (partition, curCluster);
+			break;
+		}
+
+		next = table[curCluster];
+
+		if ((links >= maxLinks) || !_FAT_fat_isValidCluster (partition, next) ||
+			(contiguous && (next != curCluster + 1)))
+		{
+			break;
+		}
+
+		curCluster = next;
+		links++;
+	}
+
+	*cluster = curCluster;
+	*nextCluster = next;
+	return links;
+}
+
+static uint32_t _FAT_fat_findFreeClusterInTable (PARTITION* partition, uint32_t startCluster) {
+	const uint32_t* table = partition->fat.table;
+	uint32_t lastCluster = partition->fat.lastCluster;
+	uint32_t curCluster;
+
+	if ((startCluster < CLUSTER_FIRST) || (startCluster > lastCluster)) {
+		startCluster = CLUSTER_FIRST;
+	}
+
+	for (curCluster = startCluster; curCluster <= lastCluster; curCluster++) {
+		if (table[curCluster] == CLUSTER_FREE) {
+			return curCluster;
+		}
+	}
+	for (curCluster = CLUSTER_FIRST; curCluster < startCluster; curCluster++) {
+		if (table[curCluster] == CLUSTER_FREE) {
+			return curCluster;
+		}
+	}
+
+	return CLUSTER_ERROR;
+}
+
+static bool _FAT_fat_freeChainInTable (PARTITION* partition, uint32_t cluster, uint32_t* clustersFreed,
+	uint32_t* lowestCluster, uint32_t* lastCluster)
+{
+	uint32_t* table = partition->fat.table;
+	uint32_t nextCluster;
+
+	*clustersFreed = 0;
+	*lowestCluster = cluster;
+	*lastCluster = cluster;
+
+	while (_FAT_fat_isValidCluster (partition, cluster)) {
+		nextCluster = table[cluster];
+		table[cluster] = CLUSTER_FREE;
+		_FAT_fat_markTableDirty (partition, cluster);
+
+		if (partition->discard) {
+			_FAT_discard_freed (partition, cluster);
+		}
+
+		if (cluster < *lowestCluster) {
+			*lowestCluster = cluster;
+		}
+		*lastCluster = cluster;
+		(*clustersFreed)++;
+
+		cluster = nextCluster;
+	}
+
+	return true;
+}
+
+static uint32_t _FAT_fat_countFreeRangeInTable (PARTITION* partition, uint32_t firstCluster, uint32_t lastCluster) {
+	const uint32_t* table = partition->fat.table;
+	uint32_t count = 0;
+	uint32_t curCluster;
+
+	for (curCluster = firstCluster; curCluster <= lastCluster; curCluster++) {
+		if (table[curCluster] == CLUSTER_FREE) {
+			count++;
+		}
+	}
+
+	return count;
+}
+
+static const FAT_FUNCTIONS _FAT_fat_functionsInTable = {
+	_FAT_fat_nextClusterInTable,
+	_FAT_fat_writeEntryInTable,
+	_FAT_fat_followChainInTable,
+	_FAT_fat_findFreeClusterInTable,
+	_FAT_fat_freeChainInTable,
+	_FAT_fat_countFreeRangeInTable
+};
+
+/*-----------------------------------------------------------------
+_FAT_fat_selectFunctions
+Pick the FAT access functions for the partition's FAT type.
+Must be called once the type and sector size are known, before
+the FAT is used.
+-----------------------------------------------------------------*/
+void _FAT_fat_selectFunctions (PARTITION* partition) {
+	partition->fat.sectorShift = 0;
+	while ((1u << partition->fat.sectorShift) < partition->bytesPerSector) {
+		partition->fat.sectorShift++;
+	}
+
+	switch (partition->filesysType) {
+		case FS_FAT12:
+			partition->fat.functions = &_FAT_fat_functions12;
+			break;
+		case FS_FAT16:
+			partition->fat.functions = &_FAT_fat_functions16;
+			break;
+		default:
+			partition->fat.functions = &_FAT_fat_functions32;
+			break;
+	}
+}
+
+/*-----------------------------------------------------------------
+_FAT_fat_tableSize
+Bytes needed to hold the FAT of a partition with lastCluster as its
+last cluster in memory
+-----------------------------------------------------------------*/
+uint32_t _FAT_fat_tableSize (uint32_t lastCluster) {
+	return (lastCluster + 1) * sizeof(uint32_t);
+}
+
+/*-----------------------------------------------------------------
+_FAT_fat_loadTable
+Read the whole FAT into memory, decoding each entry into an element
+of partition->fat.table, and switch to the FAT access functions that
+use it. Changed entries are written back by _FAT_fat_writeTable.
+Must be called after _FAT_fat_selectFunctions, before the FAT is changed.
+Returns false, leaving the FAT to be used through the cache, if there
+isn't the memory for it or the FAT can't be read.
+-----------------------------------------------------------------*/
+bool _FAT_fat_loadTable (PARTITION* partition) {
+	size_t bitmapSize = ((partition->fat.sectorsPerFat + 31) / 32) * sizeof(uint32_t);
+	uint32_t lastCluster = partition->fat.lastCluster;
+	uint32_t freeCount = CLUSTER_ERROR;
+	uint32_t* table;
+
+	// The FAT must be able to hold an entry for every cluster
+	if (_FAT_fat_entryOffset (partition->filesysType, lastCluster) + ((partition->filesysType == FS_FAT32) ? 4 : 2) >
+		(partition->fat.sectorsPerFat << partition->fat.sectorShift))
+	{
+		return false;
+	}
+
+	table = (uint32_t*) _FAT_mem_allocate (_FAT_fat_tableSize (lastCluster));
+	if (table == NULL) {
+		return false;
+	}
+	partition->fat.tableDirty = (uint32_t*) _FAT_mem_allocate (bitmapSize);
+	if (partition->fat.tableDirty == NULL) {
+		_FAT_mem_free (table);
+		return false;
+	}
+	memset (partition->fat.tableDirty, 0, bitmapSize);
+
+	// Entries 0 and 1 are reserved, and never read through the table
+	table[0] = CLUSTER_EOF;
+	table[1] = CLUSTER_EOF;
+
+	// Decode the FAT straight from the disc, so it has to be up to date there
+	if (_FAT_cache_flush (partition->cache)) {
+		switch (partition->filesysType) {
+			case FS_FAT12:
+				freeCount = _FAT_fat_countFreeRangeOfType (partition, CLUSTER_FIRST, lastCluster, table, FS_FAT12);
+				break;
+			case FS_FAT16:
+				freeCount = _FAT_fat_countFreeRangeOfType (partition, CLUSTER_FIRST, lastCluster, table, FS_FAT16);
+				break;
+			default:
+				freeCount = _FAT_fat_countFreeRangeOfType (partition, CLUSTER_FIRST, lastCluster, table, FS_FAT32);
+				break;
+		}
+	}
+	if (freeCount == CLUSTER_ERROR) {
+		_FAT_mem_free (partition->fat.tableDirty);
+		partition->fat.tableDirty = NULL;
+		_FAT_mem_free (table);
+		return false;
+	}
+
+	partition->fat.table = table;
+	partition->fat.functions = &_FAT_fat_functionsInTable;
+
+	return true;
+}
+
+/*-----------------------------------------------------------------
+_FAT_fat_writeTable
+Encode the changed entries of the in-memory FAT back into the FAT
+sectors in the cache, going through a whole sector at a time
+-----------------------------------------------------------------*/
+bool _FAT_fat_writeTable (PARTITION* partition) {
+	uint32_t* tableDirty = partition->fat.tableDirty;
+	const FS_TYPE type = partition->filesysType;
+	uint32_t lastCluster = partition->fat.lastCluster;
+	uint32_t fatSector, sectorOffset;
+	uint32_t cluster;
+	uint32_t fatOffset;
+	uint8_t* fatData;
+	sec_t sector;
+
+	if (tableDirty == NULL) {
+		return true;
+	}
+
+	for (fatSector = 0; fatSector < partition->fat.sectorsPerFat; fatSector++) {
+		// Skip quickly over unchanged parts of the FAT
+		if (tableDirty[fatSector / 32] == 0) {
+			fatSector = (fatSector / 32 + 1) * 32 - 1;
+			continue;
+		}
+		if (!(tableDirty[fatSector / 32] & (1u << (fatSector % 32)))) {
+			continue;
+		}
+
+		sector = partition->fat.fatStart + fatSector;
+		fatData = _FAT_cache_modifySector (partition->cache, sector);
+		if (fatData == NULL) {
+			return false;
+		}
+		_FAT_fat_markSectorDirty (partition, sector);
+
+		// Start from the first entry that begins in this sector
+		sectorOffset = fatSector << partition->fat.sectorShift;
+		switch (type) {
+			case FS_FAT12:
+				cluster = ((sectorOffset * 2) + 2) / 3;
+				break;
+			case FS_FAT16:
+				cluster = sectorOffset / 2;
+				break;
+			default:
+				cluster = sectorOffset / 4;
+				break;
+		}
+		if (cluster < CLUSTER_FIRST) {
+			cluster = CLUSTER_FIRST;
+		}
+
+		for (; cluster <= lastCluster; cluster++) {
+			fatOffset = _FAT_fat_entryOffset (type, cluster) - sectorOffset;
+			if (fatOffset >= partition->bytesPerSector) {
+				break;
+			}
+			// Entries that haven't changed are left as they are. The table only holds
+			// them decoded, which would turn bad cluster marks into end of chain marks.
+			if (!_FAT_fat_entryInSector (partition, type, fatOffset)) {
+				// The last entry, split with the next sector
+				if ((_FAT_fat_readSplitEntry (partition, sector, cluster) != partition->fat.table[cluster]) &&
+					!_FAT_fat_writeSplitEntry (partition, sector, cluster, partition->fat.table[cluster]))
+				{
+					return false;
+				}
+				break;
+			}
+			if (_FAT_fat_decodeEntry (type, fatData, fatOffset, cluster) != partition->fat.table[cluster]) {
+				_FAT_fat_encodeEntry (type, fatData, fatOffset, cluster, partition->fat.table[cluster]);
+			}
+		}
+
+		tableDirty[fatSector / 32] &= ~(1u << (fatSector % 32));
+	}
+
+	return true;
+}
+
+static inline bool _FAT_fat_writeFatEntry (PARTITION* partition, uint32_t cluster, uint32_t value) {
+	return partition->fat.functions->writeEntry (partition, cluster, value);
+}
+
+/*
+Keep the remembered chain ends valid after count new clusters, ending
+at newLast, are linked onto the end of a chain
+*/
+static void _FAT_fat_chainTailLinked (PARTITION* partition, uint32_t cluster, uint32_t newLast, uint32_t count) {
+	unsigned int i;
+
+	for (i = 0; i < CHAIN_TAIL_ENTRIES; i++) {
+		if ((partition->chainTails[i].startCluster != CLUSTER_FREE) && (partition->chainTails[i].lastCluster == cluster)) {
+			partition->chainTails[i].lastCluster = newLast;
+			partition->chainTails[i].chainLength += count;
+		}
+	}
+}
+
+/*
+Forget any remembered chain that starts at firstCluster or ends at lastCluster,
+after they have been freed
+*/
+static void _FAT_fat_chainTailFreed (PARTITION* partition, uint32_t firstCluster, uint32_t lastCluster) {
+	unsigned int i;
+
+	for (i = 0; i < CHAIN_TAIL_ENTRIES; i++) {
+		if ((partition->chainTails[i].startCluster == firstCluster) || (partition->chainTails[i].lastCluster == lastCluster)) {
+			partition->chainTails[i].startCluster = CLUSTER_FREE;
+		}
+	}
+}
+
+/*
+Take newly allocated clusters out of the free extent index and the
+clusters waiting to be discarded
+*/
+static void _FAT_fat_clustersAllocated (PARTITION* partition, uint32_t firstCluster, uint32_t count) {
+	FREE_INDEX* index = partition->fat.freeIndex;
+	FREE_EXTENT* extent;
+	uint32_t endCluster = firstCluster + count;	// One past the end
+	uint32_t extentEnd;
+	unsigned int i;
+
+	_FAT_discard_allocated (partition, firstCluster, count);
+
+	if ((index == NULL) || !index->valid) {
+		return;
+	}
+
+	for (i = 0; i < index->count; i++) {
+		extent = &index->extents[i];
+		extentEnd = extent->firstCluster + extent->length;
+		if ((extentEnd <= firstCluster) || (extent->firstCluster >= endCluster)) {
+			continue;
+		}
+
+		if ((extent->firstCluster < firstCluster) && (extentEnd > endCluster) && (index->count < FREE_INDEX_EXTENTS)) {
+			// Split in two, keeping the extents in order
+			memmove (extent + 2, extent + 1, (index->count - i - 1) * sizeof(FREE_EXTENT));
+			index->count++;
+			extent[1].firstCluster = endCluster;
+			extent[1].length = extentEnd - endCluster;
+			extent->length = firstCluster - extent->firstCluster;
+			i++;
+		} else if ((extent->firstCluster < firstCluster) &&
+			((extentEnd <= endCluster) || (firstCluster - extent->firstCluster >= extentEnd - endCluster)))
+		{
+			// Keep the part before the allocated clusters
+			extent->length = firstCluster - extent->firstCluster;
+		} else if (extentEnd > endCluster) {
+			// Keep the part after the allocated clusters
+			extent->firstCluster = endCluster;
+			extent->length = extentEnd - endCluster;
+		} else {
+			// All of it has been allocated
+			memmove (extent, extent + 1, (index->count - i - 1) * sizeof(FREE_EXTENT));
+			index->count--;
+			i--;
+		}
+	}
+}
+
+/*-----------------------------------------------------------------
+gets a free cluster, sets it to end of file, links the input
+cluster to it then returns the cluster number
+With the first fit policy, the first available free cluster is used.
+With the next fit policy, the search starts just after the input
+cluster, so a file's clusters end up together. For a new chain it
+starts at goal if that is a valid cluster, otherwise it carries on
+from where the previous allocation left off.
+If an error occurs, return CLUSTER_ERROR
+-----------------------------------------------------------------*/
+uint32_t _FAT_fat_linkFreeClusterNear (PARTITION* partition, uint32_t cluster, uint32_t goal) {
+	uint32_t firstFree;
+	uint32_t curLink;
+	uint32_t lastCluster;
+
+	lastCluster =  partition->fat.lastCluster;
+
+	if (cluster > lastCluster) {
+		return CLUSTER_ERROR;
+	}
+
+	// Check if the cluster already has a link, and return it if so
+	curLink = _FAT_fat_nextCluster(partition, cluster);
+	if ((curLink >= CLUSTER_FIRST) && (curLink <= lastCluster)) {
+		return curLink;	// Return the current link - don't allocate a new one
+	}
+
+	// Work out where to start looking for a free cluster
+	if (partition->fat.allocMode == FAT_MOUNT_ALLOC_FIRSTFIT) {
+		firstFree = partition->fat.firstFree;
+	} else if (_FAT_fat_isValidCluster (partition, cluster)) {
+		firstFree = cluster + 1;
+	} else if (_FAT_fat_isValidCluster (partition, goal)) {
+		firstFree = goal;
+	} else {
+		firstFree = partition->fat.firstFree;
+	}
+
+	// Search until a free cluster is found
+	firstFree = partition->fat.functions->findFreeCluster (partition, firstFree);
+	if (firstFree == CLUSTER_ERROR) {
+		// If couldn't get a free cluster then return an error
+		return CLUSTER_ERROR;
+	}
+
+	if (partition->fat.allocMode == FAT_MOUNT_ALLOC_FIRSTFIT) {
+		partition->fat.firstFree = firstFree;
+	} else {
+		// Move the rotor on past the cluster just allocated
+		partition->fat.firstFree = (firstFree < lastCluster) ? firstFree + 1 : CLUSTER_FIRST;
+	}
+	if(partition->fat.numberFreeCluster && (partition->fat.numberFreeCluster != CLUSTER_ERROR))
+		partition->fat.numberFreeCluster--;
+	partition->fat.numberLastAllocCluster = firstFree;
+	_FAT_fat_clustersAllocated (partition, firstFree, 1);
+
+	if ((cluster >= CLUSTER_FIRST) && (cluster <= lastCluster))
+	{
+		// Update the linked from FAT entry
+		_FAT_fat_writeFatEntry (partition, cluster, firstFree);
+		_FAT_fat_chainTailLinked (partition, cluster, firstFree, 1);
+	}
+	// Create the linked to FAT entry
+	_FAT_fat_writeFatEntry (partition, firstFree, CLUSTER_EOF);
+
+	return firstFree;
+}
+
+uint32_t _FAT_fat_linkFreeCluster(PARTITION* partition, uint32_t cluster) {
+	return _FAT_fat_linkFreeClusterNear (partition, cluster, CLUSTER_FREE);
+}
+
+/*-----------------------------------------------------------------
+gets a free cluster, sets it to end of file, links the input
+cluster to it, clears the new cluster to 0 valued bytes, then
+returns the cluster number. goal is used as for
+_FAT_fat_linkFreeClusterNear
+If an error occurs, return CLUSTER_ERROR
+-----------------------------------------------------------------*/
+uint32_t _FAT_fat_linkFreeClusterCleared (PARTITION* partition, uint32_t cluster, uint32_t goal) {
+	uint32_t newCluster;
 
-	switch (partition->filesysType)
-	{
-		case FS_UNKNOWN:
-			return CLUSTER_ERROR;
-			break;
+	// Link the cluster
+	newCluster = _FAT_fat_linkFreeClusterNear(partition, cluster, goal);
 
-		case FS_FAT12:
-		{
-			u32 nextCluster_h;
-			sector = partition->fat.fatStart + (((cluster * 3) / 2) / partition->bytesPerSector);
-			offset = ((cluster * 3) / 2) % partition->bytesPerSector;
+	if (newCluster == CLUSTER_FREE || newCluster == CLUSTER_ERROR) {
+		return CLUSTER_ERROR;
+	}
 
+	// Clear all the sectors within the cluster
+	_FAT_cache_zeroSectors (partition->cache, _FAT_fat_clusterToSector (partition, newCluster),
+		partition->sectorsPerCluster);
 
-			_FAT_cache_readLittleEndianValue (partition->cache, &nextCluster, sector, offset, sizeof(u8));
+	return newCluster;
+}
 
-			offset++;
+/*-----------------------------------------------------------------
+_FAT_fat_freeRunLength
+Return the number of consecutive free clusters starting at
+firstCluster, counting no further than maxLength
+-----------------------------------------------------------------*/
+uint32_t _FAT_fat_freeRunLength (PARTITION* partition, uint32_t firstCluster, uint32_t maxLength) {
+	const uint8_t* fatData = NULL;
+	sec_t fatDataSector = 0;
+	uint32_t length = 0;
 
-			if (offset >= partition->bytesPerSector) {
-				offset = 0;
-				sector++;
-			}
-			nextCluster_h = 0;
+	while ((length < maxLength) && _FAT_fat_isValidCluster (partition, firstCluster + length) &&
+		(_FAT_fat_scanEntry (partition, firstCluster + length, &fatData, &fatDataSector) == CLUSTER_FREE))
+	{
+		length++;
+	}
 
-			_FAT_cache_readLittleEndianValue (partition->cache, &nextCluster_h, sector, offset, sizeof(u8));
-			nextCluster |= (nextCluster_h << 8);
+	return length;
+}
 
-			if (cluster & 0x01) {
-				nextCluster = nextCluster >> 4;
-			} else 	{
-				nextCluster &= 0x0FFF;
-			}
+/*
+Find the first run of at least length free clusters that starts between
+firstCluster and lastCluster
+*/
+static uint32_t _FAT_fat_findFreeExtentIn (PARTITION* partition, uint32_t firstCluster, uint32_t lastCluster, uint32_t length) {
+	const uint8_t* fatData = NULL;
+	sec_t fatDataSector = 0;
+	uint32_t runStart = firstCluster;
+	uint32_t curCluster;
+	uint32_t value;
 
-			if (nextCluster >= 0x0FF7)
-			{
-				nextCluster = CLUSTER_EOF;
-			}
+	// A run starting at lastCluster may carry on past it
+	for (curCluster = firstCluster; curCluster <= partition->fat.lastCluster; curCluster++) {
+		if (runStart > lastCluster) {
+			break;
+		}
 
+		value = _FAT_fat_scanEntry (partition, curCluster, &fatData, &fatDataSector);
+		if (value == CLUSTER_ERROR) {
 			break;
 		}
-		case FS_FAT16:
-			sector = partition->fat.fatStart + ((cluster << 1) / partition->bytesPerSector);
-			offset = (cluster % (partition->bytesPerSector >> 1)) << 1;
 
-			_FAT_cache_readLittleEndianValue (partition->cache, &nextCluster, sector, offset, sizeof(u16));
+		if (value != CLUSTER_FREE) {
+			runStart = curCluster + 1;
+		} else if (curCluster - runStart + 1 >= length) {
+			return runStart;
+		}
+	}
 
-			if (nextCluster >= 0xFFF7) {
-				nextCluster = CLUSTER_EOF;
-			}
-			break;
+	return CLUSTER_ERROR;
+}
 
-		case FS_FAT32:
-			sector = partition->fat.fatStart + ((cluster << 2) / partition->bytesPerSector);
-			offset = (cluster % (partition->bytesPerSector >> 2)) << 2;
+/*-----------------------------------------------------------------
+_FAT_fat_findFreeExtent
+Find the first run of at least length free clusters at or after
+startCluster, wrapping around to the start of the FAT if needed
+Returns the first cluster of the run, or CLUSTER_ERROR if there is
+no run that long
+-----------------------------------------------------------------*/
+uint32_t _FAT_fat_findFreeExtent (PARTITION* partition, uint32_t startCluster, uint32_t length) {
+	uint32_t runStart;
 
-			_FAT_cache_readLittleEndianValue (partition->cache, &nextCluster, sector, offset, sizeof(u32));
+	if ((length == 0) || (length > partition->fat.numberFreeCluster)) {
+		return CLUSTER_ERROR;
+	}
 
-			if (nextCluster >= 0x0FFFFFF7) {
-				nextCluster = CLUSTER_EOF;
-			}
-			break;
+	if (!_FAT_fat_isValidCluster (partition, startCluster)) {
+		startCluster = CLUSTER_FIRST;
+	}
 
-		default:
-			return CLUSTER_ERROR;
-			break;
+	runStart = _FAT_fat_findFreeExtentIn (partition, startCluster, partition->fat.lastCluster, length);
+	if ((runStart == CLUSTER_ERROR) && (startCluster > CLUSTER_FIRST)) {
+		runStart = _FAT_fat_findFreeExtentIn (partition, CLUSTER_FIRST, startCluster - 1, length);
 	}
 
-	return nextCluster;
+	return runStart;
 }
 
 /*
-writes value into the correct offset within a partition's FAT, based
-on the cluster number.
+Rebuild the free extent index from the FAT, keeping the largest
+FREE_INDEX_EXTENTS runs of at least BEST_FIT_MIN_CLUSTERS clusters
 */
-static bool _FAT_fat_writeFatEntry (PARTITION* partition, uint32_t cluster, uint32_t value) {
-	sec_t sector;
-	int offset;
-	uint32_t oldValue;
-
-	if ((cluster < CLUSTER_FIRST) || (cluster > partition->fat.lastCluster /* This will catch CLUSTER_ERROR */))
-	{
-		return false;
-	}
+static bool _FAT_fat_buildFreeIndex (PARTITION* partition) {
+	FREE_INDEX* index = partition->fat.freeIndex;
+	const uint8_t* fatData = NULL;
+	sec_t fatDataSector = 0;
+	uint32_t runLength = 0;
+	uint32_t curCluster;
+	uint32_t value;
+	unsigned int smallest, i;
 
-	switch (partition->filesysType)
-	{
-		case FS_UNKNOWN:
+	if (index == NULL) {
+		index = (FREE_INDEX*) _FAT_mem_allocate (sizeof(FREE_INDEX));
+		if (index == NULL) {
 			return false;
-			break;
-
-		case FS_FAT12:
-			sector = partition->fat.fatStart + (((cluster * 3) / 2) / partition->bytesPerSector);
-			offset = ((cluster * 3) / 2) % partition->bytesPerSector;
+		}
+		partition->fat.freeIndex = index;
+	}
 
-			if (cluster & 0x01) {
+	index->valid = false;
+	index->count = 0;
 
-				_FAT_cache_readLittleEndianValue (partition->cache, &oldValue, sector, offset, sizeof(u8));
+	// Go one past the end, so the last run gets counted too
+	for (curCluster = CLUSTER_FIRST; curCluster <= partition->fat.lastCluster + 1; curCluster++) {
+		if (curCluster <= partition->fat.lastCluster) {
+			value = _FAT_fat_scanEntry (partition, curCluster, &fatData, &fatDataSector);
+			if (value == CLUSTER_ERROR) {
+				return false;
+			}
+			if (value == CLUSTER_FREE) {
+				runLength++;
+				continue;
+			}
+		}
 
-				value = (value << 4) | (oldValue & 0x0F);
+		if (runLength >= BEST_FIT_MIN_CLUSTERS) {
+			if (index->count == FREE_INDEX_EXTENTS) {
+				// Make room by dropping the smallest, if this run is larger
+				smallest = 0;
+				for (i = 1; i < index->count; i++) {
+					if (index->extents[i].length < index->extents[smallest].length) {
+						smallest = i;
+					}
+				}
+				if (index->extents[smallest].length < runLength) {
+					memmove (&index->extents[smallest], &index->extents[smallest + 1],
+						(index->count - smallest - 1) * sizeof(FREE_EXTENT));
+					index->count--;
+				}
+			}
+			if (index->count < FREE_INDEX_EXTENTS) {
+				index->extents[index->count].firstCluster = curCluster - runLength;
+				index->extents[index->count].length = runLength;
+				index->count++;
+			}
+		}
+		runLength = 0;
+	}
 
-				_FAT_cache_writeLittleEndianValue (partition->cache, value & 0xFF, sector, offset, sizeof(u8));
+	index->valid = true;
+	return true;
+}
 
-				offset++;
-				if (offset >= partition->bytesPerSector) {
-					offset = 0;
-					sector++;
-				}
+/*-----------------------------------------------------------------
+_FAT_fat_findBestFitExtent
+Find the smallest indexed run of free clusters that is at least
+length clusters long. The free extent index is rebuilt first if
+clusters have been freed since it was last built.
+Returns the first cluster of the run, or CLUSTER_ERROR if none of
+the indexed runs are long enough
+-----------------------------------------------------------------*/
+uint32_t _FAT_fat_findBestFitExtent (PARTITION* partition, uint32_t length) {
+	FREE_INDEX* index = partition->fat.freeIndex;
+	FREE_EXTENT* best = NULL;
+	unsigned int i;
 
-				_FAT_cache_writeLittleEndianValue (partition->cache, (value >> 8) & 0xFF, sector, offset, sizeof(u8));
+	if ((length == 0) || (length > partition->fat.numberFreeCluster)) {
+		return CLUSTER_ERROR;
+	}
 
-			} else {
+	if (((index == NULL) || !index->valid) && !_FAT_fat_buildFreeIndex (partition)) {
+		return CLUSTER_ERROR;
+	}
+	index = partition->fat.freeIndex;
 
-				_FAT_cache_writeLittleEndianValue (partition->cache, value, sector, offset, sizeof(u8));
+	for (i = 0; i < index->count; i++) {
+		if ((index->extents[i].length >= length) && ((best == NULL) || (index->extents[i].length < best->length))) {
+			best = &index->extents[i];
+		}
+	}
 
-				offset++;
-				if (offset >= partition->bytesPerSector) {
-					offset = 0;
-					sector++;
-				}
+	return best ? best->firstCluster : CLUSTER_ERROR;
+}
 
-				_FAT_cache_readLittleEndianValue (partition->cache, &oldValue, sector, offset, sizeof(u8));
+/*-----------------------------------------------------------------
+_FAT_fat_freeExtents
+Find every run of free clusters on the partition. If histogram is
+not NULL, histogram[i] counts the runs of 2^i to 2^(i+1)-1 clusters,
+with the last of the buckets also counting all longer runs.
+*largestExtent is set to the length of the longest run.
+Returns the number of runs
+-----------------------------------------------------------------*/
+uint32_t _FAT_fat_freeExtents (PARTITION* partition, uint32_t* histogram, unsigned int buckets, uint32_t* largestExtent) {
+	const uint8_t* fatData = NULL;
+	sec_t fatDataSector = 0;
+	uint32_t extents = 0;
+	uint32_t largest = 0;
+	uint32_t runLength = 0;
+	uint32_t curCluster;
+	uint32_t value;
+	unsigned int bucket;
 
-				value = ((value >> 8) & 0x0F) | (oldValue & 0xF0);
+	if (histogram != NULL) {
+		memset (histogram, 0, buckets * sizeof(uint32_t));
+	}
 
-				_FAT_cache_writeLittleEndianValue (partition->cache, value, sector, offset, sizeof(u8));
+	// Go one past the end, so the last run gets counted too
+	for (curCluster = CLUSTER_FIRST; curCluster <= partition->fat.lastCluster + 1; curCluster++) {
+		if (curCluster <= partition->fat.lastCluster) {
+			value = _FAT_fat_scanEntry (partition, curCluster, &fatData, &fatDataSector);
+			if (value == CLUSTER_FREE) {
+				runLength++;
+				continue;
 			}
+		}
 
-			break;
-
-		case FS_FAT16:
-			sector = partition->fat.fatStart + ((cluster << 1) / partition->bytesPerSector);
-			offset = (cluster % (partition->bytesPerSector >> 1)) << 1;
+		if (runLength > 0) {
+			extents++;
+			if (runLength > largest) {
+				largest = runLength;
+			}
+			if ((histogram != NULL) && (buckets > 0)) {
+				for (bucket = 0; (bucket < buckets - 1) && (runLength >> (bucket + 1)); bucket++);
+				histogram[bucket]++;
+			}
+			runLength = 0;
+		}
+	}
 
-			_FAT_cache_writeLittleEndianValue (partition->cache, value, sector, offset, sizeof(u16));
+	if (largestExtent) {
+		*largestExtent = largest;
+	}
+	return extents;
+}
 
-			break;
+/*-----------------------------------------------------------------
+_FAT_fat_chainExtents
+Count the runs of consecutive clusters in the chain starting at
+startCluster. *clusters is set to the length of the chain and
+*largestExtent to the length of its longest run.
+Returns the number of runs
+-----------------------------------------------------------------*/
+uint32_t _FAT_fat_chainExtents (PARTITION* partition, uint32_t startCluster, uint32_t* clusters, uint32_t* largestExtent) {
+	uint32_t totalClusters = partition->fat.lastCluster - CLUSTER_FIRST + 1;
+	uint32_t cluster = startCluster;
+	uint32_t nextCluster;
+	uint32_t extents = 0;
+	uint32_t length = 0;
+	uint32_t largest = 0;
+	uint32_t runLength;
+
+	// The length check stops a looped chain from going on forever
+	while (_FAT_fat_isValidCluster (partition, cluster) && (length < totalClusters)) {
+		runLength = _FAT_fat_followChain (partition, &cluster, &nextCluster, totalClusters - length - 1, true) + 1;
+		extents++;
+		length += runLength;
+		if (runLength > largest) {
+			largest = runLength;
+		}
+		cluster = nextCluster;
+	}
 
-		case FS_FAT32:
-			sector = partition->fat.fatStart + ((cluster << 2) / partition->bytesPerSector);
-			offset = (cluster % (partition->bytesPerSector >> 2)) << 2;
+	if (clusters) {
+		*clusters = length;
+	}
+	if (largestExtent) {
+		*largestExtent = largest;
+	}
+	return extents;
+}
 
-			_FAT_cache_writeLittleEndianValue (partition->cache, value, sector, offset, sizeof(u32));
+/*-----------------------------------------------------------------
+_FAT_fat_allocateRun
+Allocate the free clusters firstCluster to firstCluster+length-1
+as a chain in disc order, with the last one linked to nextCluster.
+The caller must have checked that they are all free.
+-----------------------------------------------------------------*/
+bool _FAT_fat_allocateRun (PARTITION* partition, uint32_t firstCluster, uint32_t length, uint32_t nextCluster) {
+	uint32_t i;
 
-			break;
+	if ((length == 0) || !_FAT_fat_isValidCluster (partition, firstCluster) ||
+		!_FAT_fat_isValidCluster (partition, firstCluster + length - 1))
+	{
+		return false;
+	}
 
-		default:
+	for (i = 0; i < length - 1; i++) {
+		if (!_FAT_fat_writeFatEntry (partition, firstCluster + i, firstCluster + i + 1)) {
 			return false;
-			break;
+		}
 	}
+	if (!_FAT_fat_writeFatEntry (partition, firstCluster + length - 1, nextCluster)) {
+		return false;
+	}
+
+	if (partition->fat.numberFreeCluster == CLUSTER_ERROR) {
+		// Still not known
+	} else if (partition->fat.numberFreeCluster > length) {
+		partition->fat.numberFreeCluster -= length;
+	} else {
+		partition->fat.numberFreeCluster = 0;
+	}
+	partition->fat.numberLastAllocCluster = firstCluster + length - 1;
+	_FAT_fat_clustersAllocated (partition, firstCluster, length);
 
 	return true;
 }
 
 /*-----------------------------------------------------------------
-gets the first available free cluster, sets it
-to end of file, links the input cluster to it then returns the
-cluster number
-If an error occurs, return CLUSTER_ERROR
+_FAT_fat_linkFreeRun
+Allocate count consecutive free clusters, set the last to end of
+file and link the input cluster to the first of them.
+The run goes straight after the input cluster if there is room.
+Otherwise a run of BEST_FIT_MIN_CLUSTERS or more goes in the best
+fitting free extent, and a shorter one in the first long enough
+free extent, looking from goal for a new chain as
+_FAT_fat_linkFreeClusterNear does.
+Returns the first cluster of the run, or CLUSTER_ERROR if there is
+no run that long
 -----------------------------------------------------------------*/
-uint32_t _FAT_fat_linkFreeCluster(PARTITION* partition, uint32_t cluster) {
+uint32_t _FAT_fat_linkFreeRun (PARTITION* partition, uint32_t cluster, uint32_t count, uint32_t goal) {
+	uint32_t lastCluster = partition->fat.lastCluster;
 	uint32_t firstFree;
-	uint32_t curLink;
-	uint32_t lastCluster;
-	bool loopedAroundFAT = false;
-
-	lastCluster =  partition->fat.lastCluster;
 
-	if (cluster > lastCluster) {
+	if ((cluster > lastCluster) || (count == 0)) {
 		return CLUSTER_ERROR;
 	}
 
-	// Check if the cluster already has a link, and return it if so
-	curLink = _FAT_fat_nextCluster(partition, cluster);
-	if ((curLink >= CLUSTER_FIRST) && (curLink <= lastCluster)) {
-		return curLink;	// Return the current link - don't allocate a new one
+	if (_FAT_fat_isValidCluster (partition, cluster) &&
+		(_FAT_fat_freeRunLength (partition, cluster + 1, count) == count))
+	{
+		firstFree = cluster + 1;
+	} else {
+		firstFree = CLUSTER_ERROR;
+		if (count >= BEST_FIT_MIN_CLUSTERS) {
+			// Large runs go in the smallest free extent they fit, leaving the larger ones whole
+			firstFree = _FAT_fat_findBestFitExtent (partition, count);
+		}
+		if (firstFree == CLUSTER_ERROR) {
+			if ((partition->fat.allocMode == FAT_MOUNT_ALLOC_NEXTFIT) && !_FAT_fat_isValidCluster (partition, cluster) &&
+				_FAT_fat_isValidCluster (partition, goal))
+			{
+				firstFree = goal;
+			} else {
+				firstFree = partition->fat.firstFree;
+			}
+			firstFree = _FAT_fat_findFreeExtent (partition, firstFree, count);
+		}
+		if (firstFree == CLUSTER_ERROR) {
+			return CLUSTER_ERROR;
+		}
 	}
 
-	// Get a free cluster
-	firstFree = partition->fat.firstFree;
-	// Start at first valid cluster
-	if (firstFree < CLUSTER_FIRST) {
-		firstFree = CLUSTER_FIRST;
+	if (!_FAT_fat_allocateRun (partition, firstFree, count, CLUSTER_EOF)) {
+		return CLUSTER_ERROR;
 	}
 
-	// Search until a free cluster is found
-	while (_FAT_fat_nextCluster(partition, firstFree) != CLUSTER_FREE) {
-		firstFree++;
-		if (firstFree > lastCluster) {
-			if (loopedAroundFAT) {
-				// If couldn't get a free cluster then return an error
-				partition->fat.firstFree = firstFree;
-				return CLUSTER_ERROR;
-			} else {
-				// Try looping back to the beginning of the FAT
-				// This was suggested by loopy
-				firstFree = CLUSTER_FIRST;
-				loopedAroundFAT = true;
-			}
+	if (partition->fat.allocMode == FAT_MOUNT_ALLOC_FIRSTFIT) {
+		if (firstFree == partition->fat.firstFree) {
+			partition->fat.firstFree = firstFree + count;
 		}
+	} else {
+		// Move the rotor on past the clusters just allocated
+		partition->fat.firstFree = firstFree + count;
+	}
+	if (partition->fat.firstFree > lastCluster) {
+		partition->fat.firstFree = CLUSTER_FIRST;
 	}
-	partition->fat.firstFree = firstFree;
-	if(partition->fat.numberFreeCluster)
-		partition->fat.numberFreeCluster--;
-	partition->fat.numberLastAllocCluster = firstFree;
 
-	if ((cluster >= CLUSTER_FIRST) && (cluster <= lastCluster))
-	{
-		// Update the linked from FAT entry
+	if (_FAT_fat_isValidCluster (partition, cluster)) {
 		_FAT_fat_writeFatEntry (partition, cluster, firstFree);
+		_FAT_fat_chainTailLinked (partition, cluster, firstFree + count - 1, count);
 	}
-	// Create the linked to FAT entry
-	_FAT_fat_writeFatEntry (partition, firstFree, CLUSTER_EOF);
 
 	return firstFree;
 }
 
 /*-----------------------------------------------------------------
-gets the first available free cluster, sets it
-to end of file, links the input cluster to it, clears the new
-cluster to 0 valued bytes, then returns the cluster number
-If an error occurs, return CLUSTER_ERROR
+_FAT_fat_setLink
+Point an allocated cluster's FAT entry at nextCluster, which may be
+CLUSTER_EOF to end the chain there. Any clusters cut off from the
+chain should be freed with _FAT_fat_clearLinks.
 -----------------------------------------------------------------*/
-uint32_t _FAT_fat_linkFreeClusterCleared (PARTITION* partition, uint32_t cluster) {
-	uint32_t newCluster;
-	uint32_t i;
-	uint8_t *emptySector;
-
-	// Link the cluster
-	newCluster = _FAT_fat_linkFreeCluster(partition, cluster);
-
-	if (newCluster == CLUSTER_FREE || newCluster == CLUSTER_ERROR) {
-		return CLUSTER_ERROR;
-	}
-
-	emptySector = (uint8_t*) _FAT_mem_allocate(partition->bytesPerSector);
-
-	// Clear all the sectors within the cluster
-	memset (emptySector, 0, partition->bytesPerSector);
-	for (i = 0; i < partition->sectorsPerCluster; i++) {
-		_FAT_cache_writeSectors (partition->cache,
-			_FAT_fat_clusterToSector (partition, newCluster) + i,
-			1, emptySector);
-	}
-
-	_FAT_mem_free(emptySector);
-
-	return newCluster;
+bool _FAT_fat_setLink (PARTITION* partition, uint32_t cluster, uint32_t nextCluster) {
+	return _FAT_fat_writeFatEntry (partition, cluster, nextCluster);
 }
 
 
 /*-----------------------------------------------------------------
 _FAT_fat_clearLinks
 frees any cluster used by a file
+Works through the FAT one sector at a time, clearing each entry
+in place within the cache and only updating the free cluster
+count and first free pointer once the whole chain is freed.
+Never releases the partition lock. Operations that free clusters
+a read with the partition unlocked could be using must call
+_FAT_partition_waitForTransfers when they start.
 -----------------------------------------------------------------*/
 bool _FAT_fat_clearLinks (PARTITION* partition, uint32_t cluster) {
-	uint32_t nextCluster;
+	uint32_t lowestCluster;
+	uint32_t lastCluster;
+	uint32_t clustersFreed;
+	uint32_t totalClusters;
+	bool flagNoError;
 
 	if ((cluster < CLUSTER_FIRST) || (cluster > partition->fat.lastCluster /* This will catch CLUSTER_ERROR */))
 		return false;
 
-	// If this clears up more space in the FAT before the current free pointer, move it backwards
-	if (cluster < partition->fat.firstFree) {
-		partition->fat.firstFree = cluster;
-	}
+	flagNoError = partition->fat.functions->freeChain (partition, cluster, &clustersFreed, &lowestCluster, &lastCluster);
 
-	while ((cluster != CLUSTER_EOF) && (cluster != CLUSTER_FREE) && (cluster != CLUSTER_ERROR)) {
-		// Store next cluster before erasing the link
-		nextCluster = _FAT_fat_nextCluster (partition, cluster);
+	if (clustersFreed > 0) {
+		_FAT_fat_chainTailFreed (partition, cluster, lastCluster);
+		if (partition->fat.freeIndex) {
+			partition->fat.freeIndex->valid = false;
+		}
+	}
 
-		// Erase the link
-		_FAT_fat_writeFatEntry (partition, cluster, CLUSTER_FREE);
+	// If this clears up more space in the FAT before the current free pointer, move it backwards.
+	// The next fit rotor only ever moves forwards.
+	if ((partition->fat.allocMode == FAT_MOUNT_ALLOC_FIRSTFIT) && (lowestCluster < partition->fat.firstFree)) {
+		partition->fat.firstFree = lowestCluster;
+	}
 
-		if(partition->fat.numberFreeCluster < (partition->numberOfSectors/partition->sectorsPerCluster))
-			partition->fat.numberFreeCluster++;
-		// Move onto next cluster
-		cluster = nextCluster;
+	totalClusters = partition->fat.lastCluster - CLUSTER_FIRST + 1;
+	if (partition->fat.numberFreeCluster != CLUSTER_ERROR) {
+		partition->fat.numberFreeCluster += clustersFreed;
+		if (partition->fat.numberFreeCluster > totalClusters) {
+			partition->fat.numberFreeCluster = totalClusters;
+		}
 	}
 
-	return true;
+	return flagNoError;
 }
 
 /*-----------------------------------------------------------------
@@ -343,13 +1557,7 @@ uint32_t _FAT_fat_trimChain (PARTITION* partition, uint32_t startCluster, unsign
 		return CLUSTER_FREE;
 	} else {
 		// Find the last cluster in the chain, and the one after it
-		chainLength--;
-		nextCluster = _FAT_fat_nextCluster (partition, startCluster);
-		while ((chainLength > 0) && (nextCluster != CLUSTER_FREE) && (nextCluster != CLUSTER_EOF)) {
-			chainLength--;
-			startCluster = nextCluster;
-			nextCluster = _FAT_fat_nextCluster (partition, startCluster);
-		}
+		_FAT_fat_followChain (partition, &startCluster, &nextCluster, chainLength - 1, false);
 
 		// Drop all clusters after the last in the chain
 		if (nextCluster != CLUSTER_FREE && nextCluster != CLUSTER_EOF) {
@@ -363,31 +1571,223 @@ uint32_t _FAT_fat_trimChain (PARTITION* partition, uint32_t startCluster, unsign
 	}
 }
 
+/*-----------------------------------------------------------------
+_FAT_fat_chainTail
+Find the last cluster in the chain starting at startCluster, and
+the number of clusters in the chain.
+The ends of recently used chains are remembered by the partition,
+so finding them again doesn't need the whole chain to be traced.
+-----------------------------------------------------------------*/
+uint32_t _FAT_fat_chainTail (PARTITION* partition, uint32_t startCluster, uint32_t* chainLength) {
+	CHAIN_TAIL* chainTail;
+	uint32_t lastCluster = startCluster;
+	uint32_t nextCluster;
+	uint32_t length;
+	unsigned int i;
+
+	if (!_FAT_fat_isValidCluster (partition, startCluster)) {
+		if (chainLength) {
+			*chainLength = 0;
+		}
+		return startCluster;
+	}
+
+	for (i = 0; i < CHAIN_TAIL_ENTRIES; i++) {
+		chainTail = &partition->chainTails[i];
+		if (chainTail->startCluster == startCluster) {
+			// Make sure it really is still the end of the chain
+			if (!_FAT_fat_isValidCluster (partition, _FAT_fat_nextCluster (partition, chainTail->lastCluster))) {
+				if (chainLength) {
+					*chainLength = chainTail->chainLength;
+				}
+				return chainTail->lastCluster;
+			}
+			chainTail->startCluster = CLUSTER_FREE;
+		}
+	}
+
+	// Trace the cluster links until the last one is found
+	length = _FAT_fat_followChain (partition, &lastCluster, &nextCluster, UINT32_MAX, false) + 1;
+
+	chainTail = &partition->chainTails[partition->nextChainTail];
+	partition->nextChainTail = (partition->nextChainTail + 1) % CHAIN_TAIL_ENTRIES;
+	chainTail->startCluster = startCluster;
+	chainTail->lastCluster = lastCluster;
+	chainTail->chainLength = length;
+
+	if (chainLength) {
+		*chainLength = length;
+	}
+	return lastCluster;
+}
+
 /*-----------------------------------------------------------------
 _FAT_fat_lastCluster
 Trace the cluster links until the last one is found
 -----------------------------------------------------------------*/
 uint32_t _FAT_fat_lastCluster (PARTITION* partition, uint32_t cluster) {
-	while ((_FAT_fat_nextCluster(partition, cluster) != CLUSTER_FREE) && (_FAT_fat_nextCluster(partition, cluster) != CLUSTER_EOF)) {
-		cluster = _FAT_fat_nextCluster(partition, cluster);
-	}
-	return cluster;
+	return _FAT_fat_chainTail (partition, cluster, NULL);
+}
+
+static void* _FAT_fat_countFreeThread (void* arg) {
+	FAT_SCAN_RANGE* range = (FAT_SCAN_RANGE*) arg;
+
+	range->freeCount = range->partition->fat.functions->countFreeRange (range->partition, range->firstCluster, range->lastCluster);
+	return NULL;
 }
 
 /*-----------------------------------------------------------------
 _FAT_fat_freeClusterCount
-Return the number of free clusters available
+Return the number of free clusters available, or CLUSTER_ERROR if
+any part of the FAT couldn't be read
+A large FAT is split into FAT_SCAN_THREADS ranges that are counted
+at the same time by worker threads, if the platform has them and the
+disc can be read by several threads at once.
+Otherwise the ranges are counted one after another.
 -----------------------------------------------------------------*/
-unsigned int _FAT_fat_freeClusterCount (PARTITION* partition) {
-	unsigned int count = 0;
-	uint32_t curCluster;
+uint32_t _FAT_fat_freeClusterCount (PARTITION* partition) {
+	FAT_SCAN_RANGE ranges[FAT_SCAN_THREADS];
+	thread_t threads[FAT_SCAN_THREADS];
+	bool started[FAT_SCAN_THREADS];
+	uint32_t clusters, rangeClusters;
+	unsigned int rangeCount;
+	uint32_t count = 0;
+	unsigned int i;
+
+	if (partition->filesysType == FS_UNKNOWN) {
+		return CLUSTER_ERROR;
+	}
 
-	for (curCluster = CLUSTER_FIRST; curCluster <= partition->fat.lastCluster; curCluster++) {
-		if (_FAT_fat_nextCluster(partition, curCluster) == CLUSTER_FREE) {
-			count++;
+	// The FAT is read straight from the disc, so it has to be up to date there
+	if (!_FAT_cache_flush (partition->cache)) {
+		return CLUSTER_ERROR;
+	}
+
+	clusters = partition->fat.lastCluster - CLUSTER_FIRST + 1;
+	// Counting a FAT held in memory isn't worth a thread
+	rangeCount = ((clusters >= FAT_SCAN_THREAD_MIN_CLUSTERS) && (partition->fat.table == NULL) &&
+		_FAT_disc_isReentrant (partition->disc)) ? FAT_SCAN_THREADS : 1;
+	rangeClusters = clusters / rangeCount;
+
+	for (i = 0; i < rangeCount; i++) {
+		ranges[i].partition = partition;
+		ranges[i].firstCluster = CLUSTER_FIRST + i * rangeClusters;
+		ranges[i].lastCluster = (i == rangeCount - 1) ? partition->fat.lastCluster : ranges[i].firstCluster + rangeClusters - 1;
+		ranges[i].freeCount = 0;
+	}
+
+	// This thread counts the first range while the workers count the others
+	for (i = 1; i < rangeCount; i++) {
+		started[i] = _FAT_thread_start (&threads[i], _FAT_fat_countFreeThread, &ranges[i]);
+	}
+	_FAT_fat_countFreeThread (&ranges[0]);
+	for (i = 1; i < rangeCount; i++) {
+		if (started[i]) {
+			_FAT_thread_join (&threads[i]);
+		} else {
+			_FAT_fat_countFreeThread (&ranges[i]);
+		}
+	}
+
+	for (i = 0; i < rangeCount; i++) {
+		if (ranges[i].freeCount == CLUSTER_ERROR) {
+			return CLUSTER_ERROR;
 		}
+		count += ranges[i].freeCount;
 	}
 
 	return count;
 }
 
+/*-----------------------------------------------------------------
+_FAT_fat_freeClusters
+Return the number of free clusters kept up to date by the partition,
+counting them first if that number isn't known.
+Returns CLUSTER_ERROR if they can't be counted.
+-----------------------------------------------------------------*/
+uint32_t _FAT_fat_freeClusters (PARTITION* partition) {
+	if (partition->fat.numberFreeCluster == CLUSTER_ERROR) {
+		partition->fat.numberFreeCluster = _FAT_fat_freeClusterCount (partition);
+	}
+	return partition->fat.numberFreeCluster;
+}
+
+
+/*-----------------------------------------------------------------
+_FAT_fat_writeMirrors
+Copy the FAT sectors changed since the last call from the active FAT
+to all the backup FATs. Runs of consecutive changed sectors are
+written with a single disc write per copy of the FAT.
+-----------------------------------------------------------------*/
+bool _FAT_fat_writeMirrors (PARTITION* partition) {
+	uint32_t* dirtySectors = partition->fat.dirtySectors;
+	uint32_t sectorsPerFat = partition->fat.sectorsPerFat;
+	uint32_t maxRun = partition->cache->sectorsPerPage;
+	uint32_t runStart, runLength;
+	uint32_t fatCopy;
+	uint32_t i;
+	uint8_t* buffer;
+	sec_t copyStart;
+
+	if (dirtySectors == NULL) {
+		return true;
+	}
+
+#ifdef LIMIT_SECTORS
+	if (maxRun > LIMIT_SECTORS) {
+		maxRun = LIMIT_SECTORS;
+	}
+#endif
+
+	buffer = (uint8_t*) _FAT_mem_align (maxRun * partition->bytesPerSector);
+	if (buffer == NULL) {
+		return false;
+	}
+
+	runStart = 0;
+	while (runStart < sectorsPerFat) {
+		// Skip quickly over unchanged parts of the FAT
+		if (dirtySectors[runStart / 32] == 0) {
+			runStart = (runStart / 32 + 1) * 32;
+			continue;
+		}
+		if (!(dirtySectors[runStart / 32] & (1u << (runStart % 32)))) {
+			runStart++;
+			continue;
+		}
+
+		// Gather a run of changed sectors
+		runLength = 0;
+		while ((runStart + runLength < sectorsPerFat) && (runLength < maxRun) &&
+			(dirtySectors[(runStart + runLength) / 32] & (1u << ((runStart + runLength) % 32))))
+		{
+			runLength++;
+		}
+
+		if (!_FAT_cache_readSectors (partition->cache, partition->fat.fatStart + runStart, runLength, buffer)) {
+			_FAT_mem_free (buffer);
+			return false;
+		}
+
+		for (fatCopy = 0; fatCopy < partition->fat.numberOfFats; fatCopy++) {
+			copyStart = partition->fat.firstFatStart + fatCopy * partition->fat.sectorsPerFat;
+			if (copyStart == partition->fat.fatStart) {
+				continue;
+			}
+			if (!_FAT_disc_writeSectors (partition->disc, copyStart + runStart, runLength, buffer)) {
+				_FAT_mem_free (buffer);
+				return false;
+			}
+			// A cache page may hold the end of one FAT and the start of the next
+			_FAT_cache_updateSectors (partition->cache, copyStart + runStart, runLength, buffer);
+		}
+
+		for (i = runStart; i < runStart + runLength; i++) {
+			dirtySectors[i / 32] &= ~(1u << (i % 32));
+		}
+		runStart += runLength;
+	}
+
+	_FAT_mem_free (buffer);
+	return true;
+}
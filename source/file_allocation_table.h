@@ -44,18 +44,59 @@
 #define CLUSTERS_PER_FAT16 65525
 
 
-uint32_t _FAT_fat_nextCluster(PARTITION* partition, uint32_t cluster);
+void _FAT_fat_selectFunctions (PARTITION* partition);
+
+uint32_t _FAT_fat_tableSize (uint32_t lastCluster);
+bool _FAT_fat_loadTable (PARTITION* partition);
+bool _FAT_fat_writeTable (PARTITION* partition);
+
+/*
+Gets the cluster linked from input cluster
+*/
+static inline uint32_t _FAT_fat_nextCluster (PARTITION* partition, uint32_t cluster) {
+	return partition->fat.functions->nextCluster (partition, cluster);
+}
+
+/*
+Follow the cluster chain from *cluster for at most maxLinks links.
+Each FAT sector is looked up in the cache once, and all links that
+stay within it are decoded directly from the cached data.
+If contiguous is true, stop at the first link that doesn't point to
+the next cluster on disc.
+On return, *cluster is the last cluster reached and *nextCluster is
+the link from it.
+Returns the number of links followed.
+*/
+static inline uint32_t _FAT_fat_followChain (PARTITION* partition, uint32_t* cluster, uint32_t* nextCluster, uint32_t maxLinks, bool contiguous) {
+	return partition->fat.functions->followChain (partition, cluster, nextCluster, maxLinks, contiguous);
+}
 
 uint32_t _FAT_fat_linkFreeCluster(PARTITION* partition, uint32_t cluster);
-uint32_t _FAT_fat_linkFreeClusterCleared (PARTITION* partition, uint32_t cluster);
+uint32_t _FAT_fat_linkFreeClusterNear (PARTITION* partition, uint32_t cluster, uint32_t goal);
+uint32_t _FAT_fat_linkFreeClusterCleared (PARTITION* partition, uint32_t cluster, uint32_t goal);
+uint32_t _FAT_fat_linkFreeRun (PARTITION* partition, uint32_t cluster, uint32_t count, uint32_t goal);
 
 bool _FAT_fat_clearLinks (PARTITION* partition, uint32_t cluster);
 
+uint32_t _FAT_fat_freeRunLength (PARTITION* partition, uint32_t firstCluster, uint32_t maxLength);
+uint32_t _FAT_fat_findFreeExtent (PARTITION* partition, uint32_t startCluster, uint32_t length);
+uint32_t _FAT_fat_findBestFitExtent (PARTITION* partition, uint32_t length);
+uint32_t _FAT_fat_freeExtents (PARTITION* partition, uint32_t* histogram, unsigned int buckets, uint32_t* largestExtent);
+uint32_t _FAT_fat_chainExtents (PARTITION* partition, uint32_t startCluster, uint32_t* clusters, uint32_t* largestExtent);
+bool _FAT_fat_allocateRun (PARTITION* partition, uint32_t firstCluster, uint32_t length, uint32_t nextCluster);
+bool _FAT_fat_setLink (PARTITION* partition, uint32_t cluster, uint32_t nextCluster);
+
 uint32_t _FAT_fat_trimChain (PARTITION* partition, uint32_t startCluster, unsigned int chainLength);
 
 uint32_t _FAT_fat_lastCluster (PARTITION* partition, uint32_t cluster);
 
-unsigned int _FAT_fat_freeClusterCount (PARTITION* partition);
+uint32_t _FAT_fat_chainTail (PARTITION* partition, uint32_t startCluster, uint32_t* chainLength);
+
+uint32_t _FAT_fat_freeClusterCount (PARTITION* partition);
+
+uint32_t _FAT_fat_freeClusters (PARTITION* partition);
+
+bool _FAT_fat_writeMirrors (PARTITION* partition);
 
 static inline sec_t _FAT_fat_clusterToSector (PARTITION* partition, uint32_t cluster) {
 	return (cluster >= CLUSTER_FIRST) ? 
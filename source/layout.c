@@ -0,0 +1,259 @@
+/*
+ layout.c
+ Reporting how files and free space are laid out on a partition
+
+ Copyright (c) 2006 Michael "Chishm" Chisholm
+
+ Redistribution and use in source and binary forms, with or without modification,
+ are permitted provided that the following conditions are met:
+
+  1. Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+  2. Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation and/or
+     other materials provided with the distribution.
+  3. The name of the author may not be used to endorse or promote products derived
+     from this software without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY
+ AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE
+ LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <string.h>
+#include <errno.h>
+
+#include "common.h"
+#include "partition.h"
+#include "directory.h"
+#include "file_allocation_table.h"
+#include "mem_allocate.h"
+#include "lock.h"
+
+// Directory levels to make room for at a time while walking the tree
+#define LAYOUT_DEPTH_STEP 16
+// No path can name anything deeper, so only a directory tree that loops back on itself goes further
+#define LAYOUT_MAX_DEPTH (PATH_MAX / 2)
+
+typedef struct {
+	DIR_ENTRY_POSITION position;
+	size_t pathLength;
+} LAYOUT_LEVEL;
+
+static void _FAT_layout_chain (PARTITION* partition, uint32_t startCluster, FAT_FILE_LAYOUT* layout) {
+	layout->extents = _FAT_fat_chainExtents (partition, startCluster, &layout->clusters, &layout->largestExtent);
+}
+
+/*
+Make room for another LAYOUT_DEPTH_STEP directory levels, keeping the ones already walked
+*/
+static LAYOUT_LEVEL* _FAT_layout_growLevels (LAYOUT_LEVEL* levels, unsigned int depth, unsigned int* capacity) {
+	LAYOUT_LEVEL* newLevels;
+
+	newLevels = (LAYOUT_LEVEL*) _FAT_mem_allocate ((*capacity + LAYOUT_DEPTH_STEP) * sizeof(LAYOUT_LEVEL));
+	if (newLevels == NULL) {
+		return NULL;
+	}
+	if (levels) {
+		memcpy (newLevels, levels, depth * sizeof(LAYOUT_LEVEL));
+		_FAT_mem_free (levels);
+	}
+	*capacity += LAYOUT_DEPTH_STEP;
+	return newLevels;
+}
+
+/*
+Go through every directory on the partition, adding up the layout of each file
+and directory. path is a buffer of PATH_MAX bytes, only used if fileCallback
+isn't NULL.
+Returns 0 once every directory has been walked, or the errno value that stopped
+it part way: ENOMEM if there was no memory to go deeper, EIO if the tree is
+deeper than any path could be.
+*/
+static int _FAT_layout_walkTree (PARTITION* partition, FAT_VOLUME_LAYOUT* volume,
+	FAT_LAYOUT_CALLBACK fileCallback, void* userData, char* path)
+{
+	LAYOUT_LEVEL* levels;
+	unsigned int capacity = 0;
+	unsigned int depth = 0;
+	FAT_FILE_LAYOUT layout;
+	DIR_ENTRY entry;
+	uint32_t cluster;
+	size_t nameLength;
+	int error = 0;
+
+	levels = _FAT_layout_growLevels (NULL, 0, &capacity);
+	if (levels == NULL) {
+		return ENOMEM;
+	}
+
+	levels[0].position.cluster = partition->rootDirCluster;
+	levels[0].position.sector = 0;
+	levels[0].position.offset = -1;	// Start before the beginning of the directory
+	levels[0].pathLength = 0;
+
+	for (;;) {
+		entry.dataEnd = levels[depth].position;
+		if (!_FAT_directory_getNextEntry (partition, &entry)) {
+			if (depth == 0) {
+				break;
+			}
+			depth--;
+			continue;
+		}
+		levels[depth].position = entry.dataEnd;
+
+		if (_FAT_directory_isDot (&entry)) {
+			continue;
+		}
+
+		cluster = _FAT_directory_entryGetCluster (partition, entry.entryData);
+		_FAT_layout_chain (partition, cluster, &layout);
+
+		if (_FAT_directory_isDirectory (&entry)) {
+			volume->directories++;
+			volume->directoryClusters += layout.clusters;
+			volume->directoryExtents += layout.extents;
+		} else {
+			volume->files++;
+			volume->fileClusters += layout.clusters;
+			volume->fileExtents += layout.extents;
+			if (layout.extents > 1) {
+				volume->fragmentedFiles++;
+			}
+		}
+
+		nameLength = strnlen (entry.filename, NAME_MAX);
+		if (fileCallback && (levels[depth].pathLength + nameLength + 2 <= PATH_MAX)) {
+			path[levels[depth].pathLength] = DIR_SEPARATOR;
+			memcpy (path + levels[depth].pathLength + 1, entry.filename, nameLength + 1);
+			if (!_FAT_directory_isDirectory (&entry)) {
+				fileCallback (path, &layout, userData);
+			}
+		}
+
+		if (_FAT_directory_isDirectory (&entry) && _FAT_fat_isValidCluster (partition, cluster)) {
+			if (depth + 1 >= LAYOUT_MAX_DEPTH) {
+				error = EIO;
+				break;
+			}
+			if (depth + 1 >= capacity) {
+				LAYOUT_LEVEL* newLevels = _FAT_layout_growLevels (levels, depth + 1, &capacity);
+				if (newLevels == NULL) {
+					error = ENOMEM;
+					break;
+				}
+				levels = newLevels;
+			}
+			depth++;
+			levels[depth].position.cluster = cluster;
+			levels[depth].position.sector = 0;
+			levels[depth].position.offset = -1;
+			levels[depth].pathLength = levels[depth - 1].pathLength + 1 + nameLength;
+		}
+	}
+
+	_FAT_mem_free (levels);
+	return error;
+}
+
+int fatGetFileLayout (const char* path, FAT_FILE_LAYOUT* layout) {
+	PARTITION* partition;
+	DIR_ENTRY dirEntry;
+
+	partition = _FAT_partition_getPartitionFromPath (path);
+	if ((partition == NULL) || (layout == NULL)) {
+		errno = (partition == NULL) ? ENODEV : EINVAL;
+		return -1;
+	}
+
+	// Move the path pointer to the start of the actual path
+	if (strchr (path, ':') != NULL) {
+		path = strchr (path, ':') + 1;
+	}
+	if (strchr (path, ':') != NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	_FAT_lock(&partition->lock);
+
+	if (!_FAT_directory_entryFromPath (partition, &dirEntry, path, NULL)) {
+		_FAT_unlock(&partition->lock);
+		errno = ENOENT;
+		return -1;
+	}
+
+	_FAT_layout_chain (partition, _FAT_directory_entryGetCluster (partition, dirEntry.entryData), layout);
+
+	_FAT_unlock(&partition->lock);
+
+	return 0;
+}
+
+int fatGetVolumeLayout (const char* name, FAT_VOLUME_LAYOUT* layout, FAT_LAYOUT_CALLBACK fileCallback, void* userData) {
+	PARTITION* partition;
+	FAT_FILE_LAYOUT rootLayout;
+	char* path = NULL;
+	int error;
+
+	partition = _FAT_partition_getPartitionFromPath (name);
+	if ((partition == NULL) || (layout == NULL)) {
+		errno = (partition == NULL) ? ENODEV : EINVAL;
+		return -1;
+	}
+
+	if (fileCallback) {
+		path = (char*) _FAT_mem_allocate (PATH_MAX);
+		if (path == NULL) {
+			errno = ENOMEM;
+			return -1;
+		}
+	}
+
+	memset (layout, 0, sizeof(FAT_VOLUME_LAYOUT));
+
+	_FAT_lock(&partition->lock);
+
+	layout->bytesPerCluster = partition->bytesPerCluster;
+	layout->totalClusters = partition->fat.lastCluster - CLUSTER_FIRST + 1;
+	layout->freeClusters = _FAT_fat_freeClusters (partition);
+	if (layout->freeClusters == CLUSTER_ERROR) {
+		_FAT_unlock(&partition->lock);
+		if (path) {
+			_FAT_mem_free (path);
+		}
+		errno = EIO;
+		return -1;
+	}
+	layout->freeExtents = _FAT_fat_freeExtents (partition, layout->freeExtentHistogram, FAT_LAYOUT_BUCKETS,
+		&layout->largestFreeExtent);
+
+	// Only a FAT32 root directory is stored in clusters
+	if (_FAT_fat_isValidCluster (partition, partition->rootDirCluster)) {
+		_FAT_layout_chain (partition, partition->rootDirCluster, &rootLayout);
+		layout->directories++;
+		layout->directoryClusters += rootLayout.clusters;
+		layout->directoryExtents += rootLayout.extents;
+	}
+
+	error = _FAT_layout_walkTree (partition, layout, fileCallback, userData, path);
+
+	_FAT_unlock(&partition->lock);
+
+	if (path) {
+		_FAT_mem_free (path);
+	}
+
+	if (error != 0) {
+		errno = error;
+		return -1;
+	}
+	return 0;
+}
@@ -70,7 +70,7 @@ static const devoptab_t dotab_fat = {
 	_FAT_stat_r, // This is lstat, but we don't support symlinks
 };
 
-bool fatMount (const char* name, const DISC_INTERFACE* interface, sec_t startSector, uint32_t cacheSize, uint32_t SectorsPerPage) {
+bool fatMountEx (const char* name, const DISC_INTERFACE* interface, sec_t startSector, uint32_t cacheSize, uint32_t SectorsPerPage, uint32_t options) {
 	PARTITION* partition;
 	devoptab_t* devops;
 	char* nameCopy;
@@ -98,7 +98,7 @@ bool fatMount (const char* name, const DISC_INTERFACE* interface, sec_t startSec
 	nameCopy = (char*)(devops+1);
 
 	// Initialize the file system
-	partition = _FAT_partition_constructor (interface, cacheSize, SectorsPerPage, startSector);
+	partition = _FAT_partition_constructor (interface, cacheSize, SectorsPerPage, startSector, options);
 	if (!partition) {
 		_FAT_mem_free (devops);
 		return false;
@@ -115,10 +115,22 @@ bool fatMount (const char* name, const DISC_INTERFACE* interface, sec_t startSec
 	return true;
 }
 
+bool fatMount (const char* name, const DISC_INTERFACE* interface, sec_t startSector, uint32_t cacheSize, uint32_t SectorsPerPage) {
+	return fatMountEx (name, interface, startSector, cacheSize, SectorsPerPage, FAT_MOUNT_DEFAULT);
+}
+
 bool fatMountSimple (const char* name, const DISC_INTERFACE* interface) {
 	return fatMount (name, interface, 0, DEFAULT_CACHE_PAGES, DEFAULT_SECTORS_PAGE);
 }
 
+uint32_t fatGetFatTableSize (const DISC_INTERFACE* interface, sec_t startSector) {
+	if (!interface) {
+		return 0;
+	}
+
+	return _FAT_partition_fatTableSize (interface, startSector);
+}
+
 void fatUnmount (const char* name) {
 	devoptab_t *devops;
 	PARTITION* partition;
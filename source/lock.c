@@ -26,4 +26,52 @@ void __attribute__ ((weak)) _FAT_unlock(mutex_t *mutex)
 	return;
 }
 
+#ifndef cond_t
+typedef int cond_t;
+#endif
+
+void __attribute__ ((weak)) _FAT_cond_init(cond_t *cond)
+{
+	return;
+}
+
+void __attribute__ ((weak)) _FAT_cond_deinit(cond_t *cond)
+{
+	return;
+}
+
+static void _FAT_cond_waitDefault(cond_t *cond, mutex_t *mutex)
+{
+	// Without a real condition, just let go of the lock for a moment
+	_FAT_unlock(mutex);
+	_FAT_lock(mutex);
+}
+
+void _FAT_cond_wait(cond_t *cond, mutex_t *mutex) __attribute__ ((weak, alias ("_FAT_cond_waitDefault")));
+
+bool _FAT_cond_available(void)
+{
+	// The default is still in use unless the program has its own
+	return _FAT_cond_wait != _FAT_cond_waitDefault;
+}
+
+void __attribute__ ((weak)) _FAT_cond_broadcast(cond_t *cond)
+{
+	return;
+}
+
+#ifndef thread_t
+typedef int thread_t;
+#endif
+
+bool __attribute__ ((weak)) _FAT_thread_start(thread_t *thread, void* (*entry)(void*), void *arg)
+{
+	return false;
+}
+
+void __attribute__ ((weak)) _FAT_thread_join(thread_t *thread)
+{
+	return;
+}
+
 #endif // USE_LWP_LOCK
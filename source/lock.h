@@ -53,6 +53,46 @@ static inline void _FAT_unlock(mutex_t *mutex)
 	LWP_MutexUnlock(*mutex);
 }
 
+static inline void _FAT_cond_init(cond_t *cond)
+{
+	LWP_CondInit(cond);
+}
+
+static inline void _FAT_cond_deinit(cond_t *cond)
+{
+	LWP_CondDestroy(*cond);
+}
+
+static inline void _FAT_cond_wait(cond_t *cond, mutex_t *mutex)
+{
+	LWP_CondWait(*cond, *mutex);
+}
+
+static inline void _FAT_cond_broadcast(cond_t *cond)
+{
+	LWP_CondBroadcast(*cond);
+}
+
+static inline bool _FAT_cond_available(void)
+{
+	return true;
+}
+
+#define FAT_THREAD_STACK_SIZE	(8 * 1024)
+#define FAT_THREAD_PRIORITY		64
+
+typedef lwp_t thread_t;
+
+static inline bool _FAT_thread_start(thread_t *thread, void* (*entry)(void*), void *arg)
+{
+	return LWP_CreateThread(thread, entry, arg, NULL, FAT_THREAD_STACK_SIZE, FAT_THREAD_PRIORITY) >= 0;
+}
+
+static inline void _FAT_thread_join(thread_t *thread)
+{
+	LWP_JoinThread(*thread, NULL);
+}
+
 #else
 
 // We still need a blank lock type
@@ -60,11 +100,47 @@ static inline void _FAT_unlock(mutex_t *mutex)
 typedef int mutex_t;
 #endif
 
+// A blank condition type
+#ifndef cond_t
+typedef int cond_t;
+#endif
+
+// And a blank thread type
+#ifndef thread_t
+typedef int thread_t;
+#endif
+
 void _FAT_lock_init(mutex_t *mutex);
 void _FAT_lock_deinit(mutex_t *mutex);
 void _FAT_lock(mutex_t *mutex);
 void _FAT_unlock(mutex_t *mutex);
 
+/*
+Condition variables, for waiting on other threads with a lock released.
+_FAT_cond_wait unlocks mutex, sleeps until _FAT_cond_broadcast is called on
+cond, then locks mutex again. A program that provides threads should provide
+these along with them.
+*/
+void _FAT_cond_init(cond_t *cond);
+void _FAT_cond_deinit(cond_t *cond);
+void _FAT_cond_wait(cond_t *cond, mutex_t *mutex);
+void _FAT_cond_broadcast(cond_t *cond);
+
+/*
+Returns true if the program provides _FAT_cond_wait. The default can't sleep,
+only let go of the lock for a moment, so nothing should be left waiting on it
+for long.
+*/
+bool _FAT_cond_available(void);
+
+/*
+Start a thread running entry(arg). Returns false if it couldn't be started,
+in which case the caller does the work itself. There are no threads by
+default, but a program can provide these along with the lock functions.
+*/
+bool _FAT_thread_start(thread_t *thread, void* (*entry)(void*), void *arg);
+void _FAT_thread_join(thread_t *thread);
+
 #endif // USE_LWP_LOCK
 
 
@@ -32,7 +32,10 @@
 #include "file_allocation_table.h"
 #include "directory.h"
 #include "mem_allocate.h"
+#include "discard.h"
 #include "fatfile.h"
+#include "aio.h"
+#include "defrag.h"
 
 #include <string.h>
 #include <ctype.h>
@@ -179,37 +182,47 @@ sec_t FindFirstValidPartition(const DISC_INTERFACE* disc)
 }
 
 
-PARTITION* _FAT_partition_constructor_buf (const DISC_INTERFACE* disc, uint32_t cacheSize, uint32_t sectorsPerPage, sec_t startSector, uint8_t *sectorBuffer)
+/*
+Read the boot sector of the partition starting at *startSector into sectorBuffer.
+If *startSector is 0 and the first sector of the disc isn't a boot sector, the
+first valid partition is used instead and *startSector is set to its start.
+Returns false if there is no FAT boot sector to be found
+*/
+static bool _FAT_partition_readBootSector (const DISC_INTERFACE* disc, sec_t* startSector, uint8_t* sectorBuffer)
 {
-	PARTITION* partition;
-
 	// Read first sector of disc
-	if (!_FAT_disc_readSectors (disc, startSector, 1, sectorBuffer)) {
-		return NULL;
+	if (!_FAT_disc_readSectors (disc, *startSector, 1, sectorBuffer)) {
+		return false;
 	}
 
 	// Make sure it is a valid MBR or boot sector
 	if ( (sectorBuffer[BPB_bootSig_55] != 0x55) || (sectorBuffer[BPB_bootSig_AA] != 0xAA)) {
-		return NULL;
+		return false;
 	}
 
-	if (startSector != 0) {
+	if (*startSector != 0) {
 		// We're told where to start the partition, so just accept it
 	} else if (!memcmp(sectorBuffer + BPB_FAT16_fileSysType, FAT_SIG, sizeof(FAT_SIG))) {
 		// Check if there is a FAT string, which indicates this is a boot sector
-		startSector = 0;
+		*startSector = 0;
 	} else if (!memcmp(sectorBuffer + BPB_FAT32_fileSysType, FAT_SIG, sizeof(FAT_SIG))) {
 		// Check for FAT32
-		startSector = 0;
+		*startSector = 0;
 	} else {
-		startSector = FindFirstValidPartition_buf(disc, sectorBuffer);
-		if (!_FAT_disc_readSectors (disc, startSector, 1, sectorBuffer)) {
-			return NULL;
+		*startSector = FindFirstValidPartition_buf(disc, sectorBuffer);
+		if (!_FAT_disc_readSectors (disc, *startSector, 1, sectorBuffer)) {
+			return false;
 		}
 	}
 
-	if (!isValidMBR(sectorBuffer))
-	{
+	return isValidMBR(sectorBuffer);
+}
+
+PARTITION* _FAT_partition_constructor_buf (const DISC_INTERFACE* disc, uint32_t cacheSize, uint32_t sectorsPerPage, sec_t startSector, uint32_t options, uint8_t *sectorBuffer)
+{
+	PARTITION* partition;
+
+	if (!_FAT_partition_readBootSector (disc, &startSector, sectorBuffer)) {
 		return NULL;
 	}
 
@@ -220,6 +233,7 @@ PARTITION* _FAT_partition_constructor_buf (const DISC_INTERFACE* disc, uint32_t
 
 	// Init the partition lock
 	_FAT_lock_init(&partition->lock);
+	_FAT_cond_init(&partition->transfersDone);
 
 	if (!memcmp(sectorBuffer + BPB_FAT16_fileSysType, FAT_SIG, sizeof(FAT_SIG)))
 		strncpy(partition->label, (char*)(sectorBuffer + BPB_FAT16_volumeLabel), 11);
@@ -242,8 +256,11 @@ PARTITION* _FAT_partition_constructor_buf (const DISC_INTERFACE* disc, uint32_t
 	}
 
 	partition->bytesPerSector = u8array_to_u16(sectorBuffer, BPB_bytesPerSector);
-	if(partition->bytesPerSector < MIN_SECTOR_SIZE || partition->bytesPerSector > MAX_SECTOR_SIZE) {
+	if(partition->bytesPerSector < MIN_SECTOR_SIZE || partition->bytesPerSector > MAX_SECTOR_SIZE ||
+		(partition->bytesPerSector & (partition->bytesPerSector - 1))) {
 		// Unsupported sector size
+		_FAT_cond_deinit(&partition->transfersDone);
+		_FAT_lock_deinit(&partition->lock);
 		_FAT_mem_free(partition);
 		return NULL;
 	}
@@ -251,6 +268,12 @@ PARTITION* _FAT_partition_constructor_buf (const DISC_INTERFACE* disc, uint32_t
 	partition->sectorsPerCluster = sectorBuffer[BPB_sectorsPerCluster];
 	partition->bytesPerCluster = partition->bytesPerSector * partition->sectorsPerCluster;
 	partition->fat.fatStart = startSector + u8array_to_u16(sectorBuffer, BPB_reservedSectors);
+	partition->fat.firstFatStart = partition->fat.fatStart;
+	partition->fat.numberOfFats = sectorBuffer[BPB_numFATs];
+	partition->fat.mirrorMode = options & FAT_MOUNT_MIRROR_MASK;
+	partition->fat.allocMode = options & FAT_MOUNT_ALLOC_MASK;
+	partition->fat.dirtySectors = NULL;
+	partition->fat.freeIndex = NULL;
 
 	partition->rootDirStart = partition->fat.fatStart + (sectorBuffer[BPB_numFATs] * partition->fat.sectorsPerFat);
 	partition->dataStart = partition->rootDirStart +
@@ -268,6 +291,9 @@ PARTITION* _FAT_partition_constructor_buf (const DISC_INTERFACE* disc, uint32_t
 	partition->fat.numberFreeCluster = 0;
 	partition->fat.numberLastAllocCluster = 0;
 
+	memset (partition->chainTails, 0, sizeof(partition->chainTails));
+	partition->nextChainTail = 0;
+
 	if (clusterCount < CLUSTERS_PER_FAT12) {
 		partition->filesysType = FS_FAT12;	// FAT12 volume
 	} else if (clusterCount < CLUSTERS_PER_FAT16) {
@@ -276,18 +302,34 @@ PARTITION* _FAT_partition_constructor_buf (const DISC_INTERFACE* disc, uint32_t
 		partition->filesysType = FS_FAT32;	// FAT32 volume
 	}
 
+	_FAT_fat_selectFunctions (partition);
+
 	if (partition->filesysType != FS_FAT32) {
 		partition->rootDirCluster = FAT16_ROOT_DIR_CLUSTER;
 	} else {
 		// Set up for the FAT32 way
 		partition->rootDirCluster = u8array_to_u32(sectorBuffer, BPB_FAT32_rootClus);
 		// Check if FAT mirroring is enabled
-		if (!(sectorBuffer[BPB_FAT32_extFlags] & 0x80)) {
-			// Use the active FAT
+		if (sectorBuffer[BPB_FAT32_extFlags] & 0x80) {
+			// Use the active FAT, and leave the others alone
 			partition->fat.fatStart = partition->fat.fatStart + ( partition->fat.sectorsPerFat * (sectorBuffer[BPB_FAT32_extFlags] & 0x0F));
+			partition->fat.mirrorMode = FAT_MOUNT_MIRROR_NONE;
 		}
 	}
 
+	// Keep track of which FAT sectors need copying to the backup FATs
+	if (partition->fat.numberOfFats > 1 && partition->fat.mirrorMode != FAT_MOUNT_MIRROR_NONE) {
+		size_t bitmapSize = ((partition->fat.sectorsPerFat + 31) / 32) * sizeof(uint32_t);
+		partition->fat.dirtySectors = (uint32_t*) _FAT_mem_allocate (bitmapSize);
+		if (partition->fat.dirtySectors == NULL) {
+			_FAT_cond_deinit(&partition->transfersDone);
+			_FAT_lock_deinit(&partition->lock);
+			_FAT_mem_free(partition);
+			return NULL;
+		}
+		memset (partition->fat.dirtySectors, 0, bitmapSize);
+	}
+
 	// Create a cache to use
 	partition->cache = _FAT_cache_constructor (cacheSize, sectorsPerPage, partition->disc, startSector+partition->numberOfSectors, partition->bytesPerSector);
 
@@ -301,48 +343,268 @@ PARTITION* _FAT_partition_constructor_buf (const DISC_INTERFACE* disc, uint32_t
 	partition->openFileCount = 0;
 	partition->firstOpenFile = NULL;
 
-	_FAT_partition_readFSinfo(partition);
+	// No defragment has been started yet
+	partition->defragState = NULL;
+
+	// No asynchronous requests have been made yet
+	partition->aio = NULL;
+
+	// Nothing is being read with the lock released
+	partition->transfers = 0;
+	partition->transferWaiters = 0;
+
+	// Hold the whole FAT in memory if asked to and there is room for it,
+	// otherwise it is used through the cache
+	partition->fat.table = NULL;
+	partition->fat.tableDirty = NULL;
+	if (options & FAT_MOUNT_FAT_IN_RAM) {
+		_FAT_fat_loadTable (partition);
+	}
+
+	// Keep track of freed clusters if the disc can be told about them
+	if (!_FAT_discard_init (partition)) {
+		_FAT_cache_destructor (partition->cache);
+		if (partition->fat.dirtySectors) {
+			_FAT_mem_free (partition->fat.dirtySectors);
+		}
+		if (partition->fat.table) {
+			_FAT_mem_free (partition->fat.table);
+			_FAT_mem_free (partition->fat.tableDirty);
+		}
+		_FAT_cond_deinit(&partition->transfersDone);
+		_FAT_lock_deinit(&partition->lock);
+		_FAT_mem_free (partition);
+		return NULL;
+	}
+
+	// Hold back whole clusters of data for delayed allocation
+	partition->delayedAllocSize = 0;
+	if (options & FAT_MOUNT_DELAYED_ALLOC) {
+		partition->delayedAllocSize = (DELAYED_ALLOC_BYTES / partition->bytesPerCluster) * partition->bytesPerCluster;
+		if (partition->delayedAllocSize == 0) {
+			partition->delayedAllocSize = partition->bytesPerCluster;
+		}
+	}
+
+	// Find out how many clusters are free. From here on it is kept up to date
+	// as clusters are allocated and freed.
+	if (partition->filesysType == FS_FAT32) {
+		_FAT_partition_readFSinfo(partition);
+	} else {
+		partition->fat.numberFreeCluster = _FAT_fat_freeClusterCount(partition);
+	}
+
+	// Carry on allocating from where the last allocation was made
+	if ((partition->fat.allocMode == FAT_MOUNT_ALLOC_NEXTFIT) &&
+		_FAT_fat_isValidCluster(partition, partition->fat.numberLastAllocCluster + 1))
+	{
+		partition->fat.firstFree = partition->fat.numberLastAllocCluster + 1;
+	}
 
 	return partition;
 }
 
-PARTITION* _FAT_partition_constructor (const DISC_INTERFACE* disc, uint32_t cacheSize, uint32_t sectorsPerPage, sec_t startSector)
+PARTITION* _FAT_partition_constructor (const DISC_INTERFACE* disc, uint32_t cacheSize, uint32_t sectorsPerPage, sec_t startSector, uint32_t options)
 {
 	uint8_t *sectorBuffer = (uint8_t*) _FAT_mem_align(MAX_SECTOR_SIZE);
 	if (!sectorBuffer) return NULL;
 	PARTITION *ret = _FAT_partition_constructor_buf(disc, cacheSize,
-			sectorsPerPage, startSector, sectorBuffer);
+			sectorsPerPage, startSector, options, sectorBuffer);
 	_FAT_mem_free(sectorBuffer);
 	return ret;
 }
 
 
+uint32_t _FAT_partition_fatTableSize (const DISC_INTERFACE* disc, sec_t startSector)
+{
+	uint8_t *sectorBuffer;
+	uint32_t sectorsPerFat, numberOfSectors, bytesPerSector;
+	uint32_t systemSectors, clusterCount;
+	uint32_t size = 0;
+
+	sectorBuffer = (uint8_t*) _FAT_mem_align(MAX_SECTOR_SIZE);
+	if (!sectorBuffer) return 0;
+
+	if (_FAT_partition_readBootSector (disc, &startSector, sectorBuffer)) {
+		sectorsPerFat = u8array_to_u16(sectorBuffer, BPB_sectorsPerFAT);
+		if (sectorsPerFat == 0) {
+			sectorsPerFat = u8array_to_u32(sectorBuffer, BPB_FAT32_sectorsPerFAT32);
+		}
+		numberOfSectors = u8array_to_u16(sectorBuffer, BPB_numSectorsSmall);
+		if (numberOfSectors == 0) {
+			numberOfSectors = u8array_to_u32(sectorBuffer, BPB_numSectors);
+		}
+		bytesPerSector = u8array_to_u16(sectorBuffer, BPB_bytesPerSector);
+
+		// The same geometry checks and sums as when mounting
+		if ((bytesPerSector >= MIN_SECTOR_SIZE) && (bytesPerSector <= MAX_SECTOR_SIZE) &&
+			!(bytesPerSector & (bytesPerSector - 1)) && (sectorBuffer[BPB_sectorsPerCluster] != 0))
+		{
+			systemSectors = u8array_to_u16(sectorBuffer, BPB_reservedSectors) + sectorBuffer[BPB_numFATs] * sectorsPerFat +
+				(u8array_to_u16(sectorBuffer, BPB_rootEntries) * DIR_ENTRY_DATA_SIZE) / bytesPerSector;
+			if (systemSectors < numberOfSectors) {
+				clusterCount = (numberOfSectors - systemSectors) / sectorBuffer[BPB_sectorsPerCluster];
+				size = _FAT_fat_tableSize (clusterCount + CLUSTER_FIRST - 1);
+			}
+		}
+	}
+
+	_FAT_mem_free(sectorBuffer);
+	return size;
+}
+
 void _FAT_partition_destructor (PARTITION* partition) {
 	FILE_STRUCT* nextFile;
 
+	// Outstanding asynchronous requests need the partition to finish
+	_FAT_aio_deinit (partition);
+
 	_FAT_lock(&partition->lock);
 
+	// Reads in other threads still need the partition
+	_FAT_partition_waitForTransfers (partition);
+
 	// Synchronize open files
 	nextFile = partition->firstOpenFile;
 	while (nextFile) {
+		_FAT_file_releasePreallocated (nextFile);
 		_FAT_syncToDisc (nextFile);
+		if (nextFile->delayedData) {
+			_FAT_mem_free (nextFile->delayedData);
+			nextFile->delayedData = NULL;
+			nextFile->delayedLength = 0;
+		}
 		nextFile = nextFile->nextOpenFile;
 	}
 
+	// Put the changes to a FAT held in memory back into the FAT sectors
+	_FAT_fat_writeTable (partition);
+
 	// Write out the fs info sector
 	_FAT_partition_writeFSinfo(partition);
 
+	// Bring the backup FATs up to date
+	if (partition->fat.mirrorMode != FAT_MOUNT_MIRROR_NONE) {
+		_FAT_fat_writeMirrors (partition);
+	}
+
 	// Free memory used by the cache, writing it to disc at the same time
 	_FAT_cache_destructor (partition->cache);
 
+	// Now the FAT is on the disc, the freed clusters can be discarded
+	_FAT_discard_issue (partition);
+	_FAT_discard_deinit (partition);
+
+	if (partition->fat.dirtySectors) {
+		_FAT_mem_free (partition->fat.dirtySectors);
+	}
+
+	if (partition->fat.freeIndex) {
+		_FAT_mem_free (partition->fat.freeIndex);
+	}
+
+	if (partition->fat.table) {
+		_FAT_mem_free (partition->fat.table);
+		_FAT_mem_free (partition->fat.tableDirty);
+	}
+
+	if (partition->defragState) {
+		_FAT_defrag_freeState (partition->defragState);
+	}
+
 	// Unlock the partition and destroy the lock
 	_FAT_unlock(&partition->lock);
+	_FAT_cond_deinit(&partition->transfersDone);
 	_FAT_lock_deinit(&partition->lock);
 
 	// Free memory used by the partition
 	_FAT_mem_free (partition);
 }
 
+/*
+Returns true if an open file has changes to its directory entry that aren't on
+the disc yet. The entry on the disc may still lead to clusters the file has freed.
+*/
+static bool _FAT_partition_entriesPending (PARTITION* partition) {
+	FILE_STRUCT* file;
+
+	for (file = partition->firstOpenFile; file; file = file->nextOpenFile) {
+		if (file->write && file->modified) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/*
+Write the FAT to the disc, and the backup copies if they are kept up to date on every flush
+*/
+static bool _FAT_partition_flushFat (PARTITION* partition) {
+	if (!_FAT_fat_writeTable (partition) ||
+		!_FAT_cache_flushSectors (partition->cache, partition->fat.fatStart, partition->fat.sectorsPerFat))
+	{
+		return false;
+	}
+
+	if ((partition->fat.mirrorMode == FAT_MOUNT_MIRROR_FLUSH) && !_FAT_fat_writeMirrors (partition)) {
+		return false;
+	}
+
+	return true;
+}
+
+bool _FAT_partition_flush (PARTITION* partition) {
+	if (!_FAT_fat_writeTable (partition) || !_FAT_cache_flush (partition->cache)) {
+		return false;
+	}
+
+	if ((partition->fat.mirrorMode == FAT_MOUNT_MIRROR_FLUSH) && !_FAT_fat_writeMirrors (partition)) {
+		return false;
+	}
+
+	// Freed clusters wait until nothing on the disc can lead to them
+	if (_FAT_partition_entriesPending (partition)) {
+		return true;
+	}
+
+	return _FAT_discard_issue (partition);
+}
+
+bool _FAT_partition_discardFreed (PARTITION* partition) {
+	if (!_FAT_discard_isFull (partition) || _FAT_partition_entriesPending (partition)) {
+		return true;
+	}
+
+	if (!_FAT_partition_flushFat (partition)) {
+		return false;
+	}
+
+	return _FAT_discard_issue (partition);
+}
+
+void _FAT_partition_waitForTransfers (PARTITION* partition) {
+	if (partition->transfers == 0) {
+		return;
+	}
+
+	partition->transferWaiters++;
+	while (partition->transfers > 0) {
+		_FAT_cond_wait(&partition->transfersDone, &partition->lock);
+	}
+	partition->transferWaiters--;
+}
+
+bool _FAT_partition_flushOwner (PARTITION* partition, const void* owner) {
+	// Data and directories go first, so that the FAT never leads to sectors that aren't on the disc
+	if (!_FAT_cache_flushOwner (partition->cache, owner, partition->fat.fatStart, partition->fat.sectorsPerFat)) {
+		return false;
+	}
+
+	// Then the whole FAT, as its sectors are shared by every file
+	return _FAT_partition_flushFat (partition);
+}
+
 PARTITION* _FAT_partition_getPartitionFromPath (const char* path) {
 	const devoptab_t *devops;
 
@@ -357,6 +619,10 @@ PARTITION* _FAT_partition_getPartitionFromPath (const char* path) {
 
 static void _FAT_updateFS_INFO(PARTITION * partition, uint8_t *sectorBuffer) {
 	partition->fat.numberFreeCluster = _FAT_fat_freeClusterCount(partition);
+	if (partition->fat.numberFreeCluster == CLUSTER_ERROR) {
+		// Leave the FS info sector alone rather than write a wrong count to it
+		return;
+	}
 	u32_to_u8array(sectorBuffer, FSIB_numberOfFreeCluster, partition->fat.numberFreeCluster);
 	u32_to_u8array(sectorBuffer, FSIB_numberLastAllocCluster, partition->fat.numberLastAllocCluster);
 	_FAT_disc_writeSectors (partition->disc, partition->fsInfoSector, 1, sectorBuffer);
@@ -391,6 +657,9 @@ void _FAT_partition_readFSinfo(PARTITION * partition)
 	if(partition->filesysType != FS_FAT32)
 		return;
 
+	// Until it is read or counted, the number of free clusters isn't known
+	partition->fat.numberFreeCluster = CLUSTER_ERROR;
+
 	uint8_t *sectorBuffer = (uint8_t*) _FAT_mem_align(partition->bytesPerSector);
 	if (!sectorBuffer) return;
 	memset(sectorBuffer, 0, partition->bytesPerSector);
@@ -408,9 +677,9 @@ void _FAT_partition_readFSinfo(PARTITION * partition)
 		_FAT_partition_createFSinfo(partition);
 	} else {
 		partition->fat.numberFreeCluster = u8array_to_u32(sectorBuffer, FSIB_numberOfFreeCluster);
-		if(partition->fat.numberFreeCluster == 0xffffffff) {
+		if(partition->fat.numberFreeCluster > partition->fat.lastCluster - CLUSTER_FIRST + 1) {
+			// Unknown (0xffffffff) or invalid count, so recount the free clusters
 			_FAT_updateFS_INFO(partition,sectorBuffer);
-			partition->fat.numberFreeCluster = u8array_to_u32(sectorBuffer, FSIB_numberOfFreeCluster);
 		}
 		partition->fat.numberLastAllocCluster = u8array_to_u32(sectorBuffer, FSIB_numberLastAllocCluster);
 	}
@@ -436,6 +705,7 @@ void _FAT_partition_writeFSinfo(PARTITION * partition)
 		return;
 	}
 
+	// A count that isn't known is written as 0xffffffff, which marks it unknown on the disc too
 	u32_to_u8array(sectorBuffer, FSIB_numberOfFreeCluster, partition->fat.numberFreeCluster);
 	u32_to_u8array(sectorBuffer, FSIB_numberLastAllocCluster, partition->fat.numberLastAllocCluster);
 
@@ -37,19 +37,52 @@
 #define MIN_SECTOR_SIZE     512
 #define MAX_SECTOR_SIZE     4096
 
+// Number of cluster chains to remember the ends of
+#define CHAIN_TAIL_ENTRIES  8
+
 // Filesystem type
 typedef enum {FS_UNKNOWN, FS_FAT12, FS_FAT16, FS_FAT32} FS_TYPE;
 
+struct _PARTITION;
+
+// Functions for accessing the FAT, specialised for each type of FAT
+typedef struct {
+	uint32_t (*nextCluster) (struct _PARTITION* partition, uint32_t cluster);
+	bool     (*writeEntry) (struct _PARTITION* partition, uint32_t cluster, uint32_t value);
+	uint32_t (*followChain) (struct _PARTITION* partition, uint32_t* cluster, uint32_t* nextCluster, uint32_t maxLinks, bool contiguous);
+	uint32_t (*findFreeCluster) (struct _PARTITION* partition, uint32_t startCluster);
+	bool     (*freeChain) (struct _PARTITION* partition, uint32_t cluster, uint32_t* clustersFreed, uint32_t* lowestCluster, uint32_t* lastCluster);
+	uint32_t (*countFreeRange) (struct _PARTITION* partition, uint32_t firstCluster, uint32_t lastCluster);
+} FAT_FUNCTIONS;
+
+typedef struct _FREE_INDEX FREE_INDEX;
+
 typedef struct {
+	const FAT_FUNCTIONS* functions;	// Chosen to suit the type of FAT when mounting
 	sec_t    fatStart;
+	sec_t    firstFatStart;			// Start of the first copy of the FAT, fatStart is the active one
+	uint32_t numberOfFats;
+	uint32_t mirrorMode;			// One of the FAT_MOUNT_MIRROR_* options
+	uint32_t allocMode;				// One of the FAT_MOUNT_ALLOC_* options
+	uint32_t* dirtySectors;			// Bitmap of the FAT sectors changed since the backup FATs were last updated
+	struct _FREE_INDEX* freeIndex;	// The largest free extents, for best fit allocation, or NULL until needed
+	uint32_t* table;				// The whole FAT decoded into memory, indexed by cluster, or NULL to use the cache
+	uint32_t* tableDirty;			// Bitmap of the FAT sectors changed in table but not yet written back to them
 	uint32_t sectorsPerFat;
+	uint32_t sectorShift;			// log2 of the sector size, to find an entry's sector without dividing
 	uint32_t lastCluster;
-	uint32_t firstFree;
-	uint32_t numberFreeCluster;
+	uint32_t firstFree;				// Where to start looking for free clusters
+	uint32_t numberFreeCluster;		// CLUSTER_ERROR if it isn't known
 	uint32_t numberLastAllocCluster;
 } FAT;
 
 typedef struct {
+	uint32_t startCluster;		// CLUSTER_FREE if this entry is unused
+	uint32_t lastCluster;
+	uint32_t chainLength;		// Number of clusters in the chain
+} CHAIN_TAIL;
+
+typedef struct _PARTITION {
 	const DISC_INTERFACE* disc;
 	CACHE*                cache;
 	// Info about the partition
@@ -64,11 +97,20 @@ typedef struct {
 	uint32_t              bytesPerCluster;
 	uint32_t              fsInfoSector;
 	FAT                   fat;
+	CHAIN_TAIL            chainTails[CHAIN_TAIL_ENTRIES];	// Recently used ends of cluster chains
+	unsigned int          nextChainTail;		// The next chainTails entry to replace
 	// Values that may change after construction
 	uint32_t              cwdCluster;			// Current working directory cluster
 	int                   openFileCount;
 	struct _FILE_STRUCT*  firstOpenFile;		// The start of a linked list of files
+	struct _DEFRAG_STATE* defragState;			// Progress through an incremental defragment, or NULL
+	struct _DISCARD_LIST* discard;				// Freed clusters waiting to be discarded, or NULL if the disc can't discard
+	struct _AIO_QUEUE*    aio;					// Requests from fatAioRead and fatAioWrite, or NULL until one is made
+	uint32_t              delayedAllocSize;		// Bytes each file may hold back before allocating clusters, 0 if not used
 	mutex_t               lock;					// A lock for partition operations
+	unsigned int          transfers;			// Reads from the disc going on with the lock released
+	unsigned int          transferWaiters;		// Threads waiting for those reads to finish
+	cond_t                transfersDone;		// Signalled when the last of those reads finishes
 	bool                  readOnly;				// If this is set, then do not try writing to the disc
 	char                  label[12];			// Volume label
 } PARTITION;
@@ -76,7 +118,14 @@ typedef struct {
 /*
 Mount the supplied device and return a pointer to the struct necessary to use it
 */
-PARTITION* _FAT_partition_constructor (const DISC_INTERFACE* disc, uint32_t cacheSize, uint32_t SectorsPerPage, sec_t startSector);
+PARTITION* _FAT_partition_constructor (const DISC_INTERFACE* disc, uint32_t cacheSize, uint32_t SectorsPerPage, sec_t startSector, uint32_t options);
+
+/*
+Bytes needed to hold the FAT of the partition at startSector in memory, as
+mounting it with FAT_MOUNT_FAT_IN_RAM would. startSector is found as when mounting.
+Returns 0 if there isn't a FAT partition there
+*/
+uint32_t _FAT_partition_fatTableSize (const DISC_INTERFACE* disc, sec_t startSector);
 
 /*
 Dismount the device and free all structures used.
@@ -84,6 +133,41 @@ Will also attempt to synchronise all open files to disc.
 */
 void _FAT_partition_destructor (PARTITION* partition);
 
+/*
+Write all cached data for the partition to disc, including the backup
+copies of the FAT if they are kept up to date on every flush. Freed
+clusters are then discarded, unless an open file's directory entry on
+the disc may still lead to them.
+Does no locking of its own -- lock the partition before calling.
+*/
+bool _FAT_partition_flush (PARTITION* partition);
+
+/*
+Discard the freed clusters if a full batch of them is waiting and nothing
+on the disc can still lead to them, writing the FAT out first. Call once
+the directory entries an operation changed are on the disc.
+Does no locking of its own -- lock the partition before calling.
+*/
+bool _FAT_partition_discardFreed (PARTITION* partition);
+
+/*
+Write the cached data that owner depends on -- the pages it dirtied, and those
+holding metadata or dirtied by more than one owner -- followed by the FAT. Pages
+that only other owners dirtied are left in the cache. Freed clusters aren't
+discarded, as the other owners' changes to the FAT may not be on the disc yet.
+Does no locking of its own -- lock the partition before calling.
+*/
+bool _FAT_partition_flushOwner (PARTITION* partition, const void* owner);
+
+/*
+Wait until no reads are going on with the partition lock released. Call this
+straight after locking the partition in an operation that frees or moves
+clusters such reads could be using, before looking anything up, as the lock
+is released while waiting. No more of those reads start until the operation
+unlocks the partition.
+*/
+void _FAT_partition_waitForTransfers (PARTITION* partition);
+
 /*
 Return the partition specified in a path, as taken from the devoptab.
 */